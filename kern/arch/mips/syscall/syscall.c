@@ -36,6 +36,7 @@
 #include <thread.h>
 #include <current.h>
 #include <syscall.h>
+#include <copyinout.h>
 
 
 /*
@@ -165,6 +166,33 @@ syscall(struct trapframe *tf)
 		err = sys_lseek((int)tf->tf_a0,(off_t)tf->tf_a1,(int)tf->tf_a2);
 		break;
 
+		case SYS_sbrk:
+		err = (int32_t)sys_sbrk((intptr_t)tf->tf_a0);
+		break;
+
+		case SYS_mmap:
+		{
+			// The fd and the 64-bit offset do not fit in a0-a3 and
+			// are passed on the user stack.
+			int fd;
+			off_t offset;
+			err = copyin((const_userptr_t)(tf->tf_sp + 16), &fd, sizeof(fd));
+			if(!err) {
+				err = copyin((const_userptr_t)(tf->tf_sp + 24), &offset, sizeof(offset));
+			}
+			if(err) {
+				err = -err;
+				break;
+			}
+			err = (int32_t)sys_mmap((void*)tf->tf_a0, (size_t)tf->tf_a1,
+					(int)tf->tf_a2, (int)tf->tf_a3, fd, offset);
+		}
+		break;
+
+		case SYS_munmap:
+		err = sys_munmap((void*)tf->tf_a0, (size_t)tf->tf_a1);
+		break;
+
 	    default:
 		kprintf("Unknown syscall %d\n", callno);
 		err = -ENOSYS;
@@ -0,0 +1,731 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/stat.h>
+#include <lib.h>
+#include <synch.h>
+#include <vfs.h>
+#include <uio.h>
+#include <vnode.h>
+#include <vm.h>
+#include <pagetable.h>
+#include <addrspace.h>
+#include <swap.h>
+#include <zswap.h>
+
+/*
+ * Swap slot map. Level 0 has one bit per slot, set while the slot is
+ * in use. Every level above has one bit per word of the level below,
+ * set while that word is full, and the top level is a single word. A
+ * free slot is found by following clear bits down from the top, so
+ * allocating and freeing touch one word per level.
+ *
+ * Four levels of 32 bits cover 2^20 slots, as many as a PTE can name.
+ */
+#define SWAPMAP_LEVELS	4
+#define SWAPMAP_BITS	32
+#define SWAPMAP_FULL	((uint32_t)-1)
+#define SWAPMAP_MAXSLOTS	(1U << 20)
+
+struct swapmap {
+	uint32_t * Level[SWAPMAP_LEVELS];
+	size_t Words[SWAPMAP_LEVELS];
+	unsigned Depth;
+	size_t Slots;
+	size_t Used;
+};
+
+/*
+ * Swap devices. Each has its own slot map, and its slots are numbered
+ * from Base up in the single slot space PTEs use, one device after
+ * another. New pages go to the device with the fewest transfers under
+ * way, taking turns between equally busy ones, so paging spreads over
+ * all of them. Transfers on different devices run at the same time;
+ * IoLock keeps them to one at a time per device.
+ *
+ * swaplock covers the slot maps, Inflight, and the compressed pool.
+ * It may be held while taking an IoLock, never the other way round.
+ * swapon_lock keeps devices being added one at a time.
+ */
+#define SWAP_MAXDEVS	8
+
+struct swapdev {
+	char * Name;
+	struct vnode * Vnode;
+	struct lock * IoLock;
+	struct swapmap Map;
+	size_t Base;
+	unsigned Inflight;
+};
+
+static struct swapdev swapdevs[SWAP_MAXDEVS];
+static unsigned nswapdevs = 0;
+static unsigned swapdev_next = 0;       // where the tie-break turn starts
+static size_t swapslots = 0;            // slots on all devices together
+static size_t swapreserved = 0;         // free slots promised; see swap_reserve
+
+static struct lock * swaplock = NULL;
+static struct lock * swapon_lock = NULL;
+
+/*
+ * Broadcast, under swaplock, whenever busy PTEs are let go; see
+ * SwapWait.
+ */
+static struct cv * swapbusy_cv = NULL;
+
+/*
+ * Readahead window: the most pages SwapInCluster reads per fault,
+ * counting the faulting one. It grows by one for every readahead page
+ * that gets used and halves for every one that is evicted unused.
+ */
+static unsigned readahead_window = 2;
+
+static
+int
+SwapMapInit(struct swapmap * map, size_t slots)
+{
+	size_t bits = slots;
+	map->Slots = slots;
+	map->Used = 0;
+	map->Depth = 0;
+	do {
+		KASSERT(map->Depth < SWAPMAP_LEVELS);
+		unsigned l = map->Depth++;
+		size_t words = (bits + SWAPMAP_BITS - 1) / SWAPMAP_BITS;
+		map->Words[l] = words;
+		map->Level[l] = kmalloc(words * sizeof(uint32_t));
+		if(map->Level[l] == NULL) {
+			while(l-- > 0) {
+				kfree(map->Level[l]);
+			}
+			return ENOMEM;
+		}
+		bzero(map->Level[l], words * sizeof(uint32_t));
+		// The bits past the end stand for nothing; mark them in
+		// use. The last word still has a real bit clear, so this
+		// never fills it.
+		for(size_t b = bits; b != words * SWAPMAP_BITS; b++) {
+			map->Level[l][b / SWAPMAP_BITS] |= 1U << (b % SWAPMAP_BITS);
+		}
+		bits = words;
+	} while(bits > 1);
+	return 0;
+}
+
+static
+bool
+SwapMapIsUsed(struct swapmap * map, size_t idx)
+{
+	return (map->Level[0][idx / SWAPMAP_BITS] & (1U << (idx % SWAPMAP_BITS))) != 0;
+}
+
+/* Mark a free slot in use, and the parent's bit for every word that fills. */
+static
+void
+SwapMapTake(struct swapmap * map, size_t idx)
+{
+	KASSERT(idx < map->Slots && !SwapMapIsUsed(map, idx));
+	size_t bit = idx;
+	for(unsigned l = 0; l != map->Depth; l++) {
+		uint32_t * word = &map->Level[l][bit / SWAPMAP_BITS];
+		*word |= 1U << (bit % SWAPMAP_BITS);
+		if(*word != SWAPMAP_FULL) {
+			break;
+		}
+		bit /= SWAPMAP_BITS;
+	}
+	map->Used++;
+}
+
+/*
+ * Take the lowest free slot and as many free slots straight after it
+ * as are wanted, up to WANT in all. The number taken goes in *GOT.
+ * Returns the first slot, or (size_t)-1 if the map is full.
+ */
+static
+size_t
+SwapMapAllocRun(struct swapmap * map, unsigned want, unsigned * got)
+{
+	*got = 0;
+	unsigned top = map->Depth - 1;
+	if(map->Level[top][0] == SWAPMAP_FULL) {
+		return (size_t)-1;
+	}
+	size_t idx = 0;
+	for(int l = top; l >= 0; l--) {
+		uint32_t word = map->Level[l][idx];
+		KASSERT(word != SWAPMAP_FULL);
+		idx = idx * SWAPMAP_BITS + __builtin_ctz(~word);
+	}
+	while(*got < want && idx + *got < map->Slots && !SwapMapIsUsed(map, idx + *got)) {
+		SwapMapTake(map, idx + *got);
+		*got += 1;
+	}
+	KASSERT(*got > 0);
+	return idx;
+}
+
+static
+void
+SwapMapFree(struct swapmap * map, size_t idx)
+{
+	KASSERT(idx < map->Slots);
+	size_t bit = idx;
+	for(unsigned l = 0; l != map->Depth; l++) {
+		uint32_t * word = &map->Level[l][bit / SWAPMAP_BITS];
+		bool wasfull = *word == SWAPMAP_FULL;
+		KASSERT(*word & (1U << (bit % SWAPMAP_BITS)));
+		*word &= ~(1U << (bit % SWAPMAP_BITS));
+		if(!wasfull) {
+			break;
+		}
+		bit /= SWAPMAP_BITS;
+	}
+	map->Used--;
+}
+
+/* The device holding the global slot SLOT. */
+static
+struct swapdev *
+SwapDev(size_t slot)
+{
+	for(unsigned i = 0; i != nswapdevs; i++) {
+		struct swapdev * dev = &swapdevs[i];
+		if(slot >= dev->Base && slot < dev->Base + dev->Map.Slots) {
+			return dev;
+		}
+	}
+	panic("Swap slot %u is on no device\n", (unsigned)slot);
+}
+
+/*
+ * The device new pages should go to: the least busy one with a free
+ * slot, taking turns on a tie. NULL if every device is full.
+ */
+static
+struct swapdev *
+SwapPickDev(void)
+{
+	struct swapdev * best = NULL;
+	for(unsigned k = 0; k != nswapdevs; k++) {
+		struct swapdev * dev = &swapdevs[(swapdev_next + k) % nswapdevs];
+		if(dev->Map.Used == dev->Map.Slots) {
+			continue;
+		}
+		if(best == NULL || dev->Inflight < best->Inflight) {
+			best = dev;
+		}
+	}
+	if(best != NULL) {
+		swapdev_next = (best - swapdevs + 1) % nswapdevs;
+	}
+	return best;
+}
+
+static
+void
+SwapSlotRelease(size_t slot)
+{
+	struct swapdev * dev = SwapDev(slot);
+	SwapMapFree(&dev->Map, slot - dev->Base);
+}
+
+/*
+ * Move the N pages at KADDRS to or from the slots starting at SLOT,
+ * which must all be on one device, in one transfer. Called without
+ * swaplock; see SwapIoStart.
+ */
+static
+void
+SwapTransfer(size_t slot, const vaddr_t * kaddrs, unsigned n, enum uio_rw rw)
+{
+	struct iovec iov[SWAP_CLUSTER];
+	struct uio ku;
+	KASSERT(n <= SWAP_CLUSTER);
+
+	struct swapdev * dev = SwapDev(slot);
+	KASSERT(slot + n <= dev->Base + dev->Map.Slots);
+	for(unsigned i = 0; i != n; i++) {
+		iov[i].iov_kbase = (void *)kaddrs[i];
+		iov[i].iov_len = PAGE_SIZE;
+	}
+	ku.uio_iov = iov;
+	ku.uio_iovcnt = n;
+	ku.uio_offset = (off_t)(slot - dev->Base) * PAGE_SIZE;
+	ku.uio_resid = n * PAGE_SIZE;
+	ku.uio_segflg = UIO_SYSSPACE;
+	ku.uio_rw = rw;
+	ku.uio_space = NULL;
+
+	lock_acquire(dev->IoLock);
+	int err = rw == UIO_READ ? VOP_READ(dev->Vnode, &ku) : VOP_WRITE(dev->Vnode, &ku);
+	lock_release(dev->IoLock);
+	if(err) {
+		panic("Swap %s on %s failed: %s\n", rw == UIO_READ ? "read" : "write",
+				dev->Name, strerror(err));
+	}
+}
+
+/*
+ * Count a transfer to or from the device of SLOT as under way, for
+ * SwapPickDev, from before swaplock is let go until it is done.
+ */
+static
+void
+SwapIoStart(size_t slot)
+{
+	KASSERT(lock_do_i_hold(swaplock));
+	SwapDev(slot)->Inflight++;
+}
+
+static
+void
+SwapIoDone(size_t slot)
+{
+	KASSERT(lock_do_i_hold(swaplock));
+	SwapDev(slot)->Inflight--;
+}
+
+/*
+ * Keep the page at KADDR compressed in memory as the contents of SLOT
+ * instead of writing it, spilling older pages to disk to make room.
+ * Returns false if it has to be written after all.
+ */
+static
+bool
+SwapCompress(size_t slot, vaddr_t kaddr)
+{
+	if(zswap_compress((const void *)kaddr) == 0) {
+		return false;
+	}
+	while(!zswap_store(slot)) {
+		uint32_t victim;
+		const void * page = zswap_evict(&victim);
+		if(page == NULL) {
+			return false;
+		}
+		// Written with swaplock still held, so nobody can look for
+		// the page between leaving the pool and reaching the disk.
+		vaddr_t spill = (vaddr_t)page;
+		SwapTransfer(victim, &spill, 1, UIO_WRITE);
+	}
+	return true;
+}
+
+int
+swap_adddev(const char * path)
+{
+	struct stat st;
+	struct vnode * vn;
+	char * name = kstrdup(path);
+	if(name == NULL) {
+		return ENOMEM;
+	}
+
+	lock_acquire(swapon_lock);
+	int err = 0;
+	for(unsigned i = 0; i != nswapdevs; i++) {
+		if(strcmp(swapdevs[i].Name, name) == 0) {
+			err = EBUSY;
+		}
+	}
+	if(err == 0 && nswapdevs == SWAP_MAXDEVS) {
+		err = ENOSPC;
+	}
+	if(err == 0) {
+		// vfs_open may change the name it is given.
+		char * pathcopy = kstrdup(path);
+		err = pathcopy == NULL ? ENOMEM : vfs_open(pathcopy, O_RDWR, 0, &vn);
+		kfree(pathcopy);
+	}
+	if(err) {
+		lock_release(swapon_lock);
+		kfree(name);
+		return err;
+	}
+
+	struct swapdev * dev = &swapdevs[nswapdevs];
+	size_t slots = 0;
+	err = VOP_STAT(vn, &st);
+	if(err == 0) {
+		slots = MIN((size_t)(st.st_size / PAGE_SIZE), SWAPMAP_MAXSLOTS - swapslots);
+		err = slots == 0 ? ENOSPC : 0;
+	}
+	if(err == 0) {
+		err = SwapMapInit(&dev->Map, slots);
+	}
+	if(err == 0) {
+		dev->IoLock = lock_create(name);
+		if(dev->IoLock == NULL) {
+			// Map.Depth levels were allocated.
+			for(unsigned l = 0; l != dev->Map.Depth; l++) {
+				kfree(dev->Map.Level[l]);
+			}
+			err = ENOMEM;
+		}
+	}
+	if(err) {
+		lock_release(swapon_lock);
+		vfs_close(vn);
+		kfree(name);
+		return err;
+	}
+	dev->Name = name;
+	dev->Vnode = vn;
+	dev->Base = swapslots;
+	dev->Inflight = 0;
+
+	// Only now can the pageout path see it.
+	lock_acquire(swaplock);
+	swapslots += slots;
+	nswapdevs++;
+	lock_release(swaplock);
+	lock_release(swapon_lock);
+	return 0;
+}
+
+int
+cmd_swapon(int nargs, char ** args)
+{
+	if(nargs != 2) {
+		kprintf("Usage: swapon device\n");
+		return EINVAL;
+	}
+	int err = swap_adddev(args[1]);
+	if(err) {
+		kprintf("swapon: %s: %s\n", args[1], strerror(err));
+		return err;
+	}
+	kprintf("swapon: %s: %u free slots of %u\n", args[1],
+			(unsigned)swap_freeslots(), (unsigned)swapslots);
+	return 0;
+}
+
+void
+vm_swapbootstrap()
+{
+	static const char * const bootdevs[] = { "LHD0.img", "LHD1.img" };
+
+	swaplock = lock_create("SwapLock");
+	KASSERT(swaplock != NULL);
+	swapon_lock = lock_create("SwaponLock");
+	KASSERT(swapon_lock != NULL);
+	swapbusy_cv = cv_create("SwapBusy");
+	KASSERT(swapbusy_cv != NULL);
+	zswap_bootstrap();
+
+	for(unsigned i = 0; i != sizeof(bootdevs) / sizeof(bootdevs[0]); i++) {
+		int err = swap_adddev(bootdevs[i]);
+		if(err) {
+			kprintf("swap: %s: %s\n", bootdevs[i], strerror(err));
+		}
+	}
+	if(nswapdevs == 0) {
+		kprintf("swap: no swap devices; add one with swapon\n");
+	}
+
+	// Nothing can be paged out before this point.
+	vm_pageoutbootstrap();
+}
+
+unsigned
+swap_reserve(unsigned want)
+{
+	if(swaplock == NULL) {
+		return 0;
+	}
+	lock_acquire(swaplock);
+	size_t free = swap_freeslots() - swapreserved;
+	unsigned got = MIN(want, free);
+	swapreserved += got;
+	lock_release(swaplock);
+	return got;
+}
+
+void
+swap_unreserve(unsigned n)
+{
+	if(n == 0) {
+		return;
+	}
+	lock_acquire(swaplock);
+	KASSERT(swapreserved >= n);
+	swapreserved -= n;
+	lock_release(swaplock);
+}
+
+size_t
+swap_freeslots(void)
+{
+	size_t free = 0;
+	for(unsigned i = 0; i != nswapdevs; i++) {
+		free += swapdevs[i].Map.Slots - swapdevs[i].Map.Used;
+	}
+	return free;
+}
+
+size_t
+swap_usedslots(void)
+{
+	size_t used = 0;
+	for(unsigned i = 0; i != nswapdevs; i++) {
+		used += swapdevs[i].Map.Used;
+	}
+	return used;
+}
+
+int
+SwapIn(struct PTE * pte)
+{
+	if(pte->isInMemory == true) {
+		return 0;
+	}
+	size_t idx = pte->location;
+	vaddr_t kaddr = alloc_kpages_swapable(1);
+	if(kaddr == 0) {
+		return ENOMEM;
+	}
+
+	lock_acquire(swaplock);
+	// A page from the compressed pool leaves it, and its slot: the
+	// next swap out compresses it afresh.
+	bool compressed = zswap_load(idx, (void *)kaddr);
+	if(compressed) {
+		SwapSlotRelease(idx);
+	} else {
+		SwapIoStart(idx);
+		lock_release(swaplock);
+		SwapTransfer(idx, &kaddr, 1, UIO_READ);
+		lock_acquire(swaplock);
+		SwapIoDone(idx);
+	}
+
+	pte->location = KVADDR_TO_PPN(kaddr);
+	pte->isInMemory = true;
+	pte->dirty = compressed;
+	lock_release(swaplock);
+	if(!compressed) {
+		coremap_setslot(kaddr, idx);
+	}
+	return 0;
+}
+
+void
+swap_readahead_hit(void)
+{
+	if(readahead_window < SWAP_CLUSTER) {
+		readahead_window++;
+	}
+}
+
+void
+swap_readahead_miss(void)
+{
+	if(readahead_window > 1) {
+		readahead_window /= 2;
+	}
+}
+
+int
+SwapInCluster(struct addrspace * as, vaddr_t addr, vaddr_t limit)
+{
+	struct PTE * ptes[SWAP_CLUSTER];
+	vaddr_t kaddrs[SWAP_CLUSTER];
+
+	struct PTE * pte = PageTableFind(as->pagetable, addr, false);
+	KASSERT(pte != NULL && pte->valid);
+	if(pte->isInMemory) {
+		return 0;
+	}
+	ptes[0] = pte;
+	kaddrs[0] = alloc_kpages_swapable(1);
+	if(kaddrs[0] == 0) {
+		return ENOMEM;
+	}
+	size_t slot = pte->location;
+
+	// Only the neighbours that are next to it in swap as well, and
+	// only while there is free memory for them.
+	unsigned n = 1;
+	unsigned window = readahead_window;
+	while(n < window && addr + n * PAGE_SIZE < limit) {
+		struct PTE * npte = PageTableFind(as->pagetable, addr + n * PAGE_SIZE, false);
+		if(npte == NULL || !npte->valid || npte->busy || npte->isInMemory ||
+				npte->location != slot + n) {
+			break;
+		}
+		vaddr_t kaddr = alloc_kpages_swapable_noevict(1);
+		if(kaddr == 0) {
+			break;
+		}
+		ptes[n] = npte;
+		kaddrs[n] = kaddr;
+		n++;
+	}
+
+	unsigned allocated = n;
+	lock_acquire(swaplock);
+	// A page in the compressed pool needs no disk read, and is not
+	// worth reading ahead around; see SwapIn.
+	bool compressed = zswap_load(slot, (void *)kaddrs[0]);
+	if(compressed) {
+		SwapSlotRelease(slot);
+		n = 1;
+	} else {
+		// One transfer: stop at the end of the device, or at a
+		// neighbour held in the pool.
+		struct swapdev * dev = SwapDev(slot);
+		for(unsigned i = 1; i != n; i++) {
+			if(slot + i >= dev->Base + dev->Map.Slots || zswap_contains(slot + i)) {
+				n = i;
+				break;
+			}
+		}
+		SwapIoStart(slot);
+		lock_release(swaplock);
+		SwapTransfer(slot, kaddrs, n, UIO_READ);
+		lock_acquire(swaplock);
+		SwapIoDone(slot);
+	}
+
+	for(unsigned i = 0; i != n; i++) {
+		ptes[i]->location = KVADDR_TO_PPN(kaddrs[i]);
+		ptes[i]->isInMemory = true;
+		ptes[i]->dirty = compressed;
+		if(i > 0) {
+			ptes[i]->readahead = true;
+			ptes[i]->useCount = 0;
+		}
+	}
+	lock_release(swaplock);
+
+	for(unsigned i = n; i != allocated; i++) {
+		free_kpages(kaddrs[i]);
+	}
+	if(compressed) {
+		return 0;
+	}
+	// Keep the slots as clean copies. Make the extra pages
+	// evictable; the faulting one is mapped by as_pagefault.
+	for(unsigned i = 0; i != n; i++) {
+		coremap_setslot(kaddrs[i], slot + i);
+		if(i > 0) {
+			coremap_map(kaddrs[i], as, addr + i * PAGE_SIZE);
+		}
+	}
+	return 0;
+}
+
+/*
+ * Write the pages of PTES to swap. Pages that compress well stay in
+ * the compressed pool instead; the rest that land in consecutive slots
+ * go out in a single write.
+ *
+ * Slots are handed out a run at a time, each run from the device
+ * SwapPickDev chooses, and the writes happen once swaplock is let go.
+ * The PTEs only point at the slots once the data is there. They stay
+ * busy, and the frames are left to the caller. The caller must have
+ * reserved the N slots.
+ */
+void
+SwapOutCluster(struct PTE ** ptes, unsigned n)
+{
+	vaddr_t kaddrs[SWAP_CLUSTER];
+	size_t slots[SWAP_CLUSTER];
+	bool ondisk[SWAP_CLUSTER];
+	KASSERT(n <= SWAP_CLUSTER);
+
+	for(unsigned i = 0; i != n; i++) {
+		KASSERT(ptes[i]->busy);
+		kaddrs[i] = PTE_KVADDR(ptes[i]);
+	}
+	lock_acquire(swaplock);
+	KASSERT(swapreserved >= n);
+	swapreserved -= n;
+	for(unsigned done = 0; done != n; ) {
+		struct swapdev * dev = SwapPickDev();
+		KASSERT(dev != NULL);
+		unsigned got;
+		size_t idx = SwapMapAllocRun(&dev->Map, n - done, &got);
+		KASSERT(idx != (size_t)-1);
+		for(unsigned i = 0; i != got; i++) {
+			slots[done + i] = dev->Base + idx + i;
+			ondisk[done + i] = !SwapCompress(slots[done + i], kaddrs[done + i]);
+			if(ondisk[done + i]) {
+				SwapIoStart(slots[done + i]);
+			}
+		}
+		done += got;
+	}
+	lock_release(swaplock);
+
+	// Write each run of consecutive slots that is not kept compressed.
+	for(unsigned i = 0; i != n; ) {
+		if(!ondisk[i]) {
+			i++;
+			continue;
+		}
+		unsigned j = i + 1;
+		while(j != n && ondisk[j] && slots[j] == slots[i] + (j - i) &&
+				SwapDev(slots[j]) == SwapDev(slots[i])) {
+			j++;
+		}
+		SwapTransfer(slots[i], &kaddrs[i], j - i, UIO_WRITE);
+		i = j;
+	}
+
+	lock_acquire(swaplock);
+	for(unsigned i = 0; i != n; i++) {
+		if(ondisk[i]) {
+			SwapIoDone(slots[i]);
+		}
+		ptes[i]->isInMemory = false;
+		ptes[i]->location = slots[i];
+	}
+	lock_release(swaplock);
+}
+
+void
+SwapWake(struct PTE ** ptes, unsigned n)
+{
+	if(n == 0) {
+		return;
+	}
+	lock_acquire(swaplock);
+	for(unsigned i = 0; i != n; i++) {
+		KASSERT(ptes[i]->busy);
+		ptes[i]->busy = false;
+	}
+	cv_broadcast(swapbusy_cv, swaplock);
+	lock_release(swaplock);
+}
+
+void
+SwapWait(struct PTE * pte)
+{
+	// Only the pageout path sets busy, and only after swap is up.
+	if(!pte->busy) {
+		return;
+	}
+	lock_acquire(swaplock);
+	while(pte->busy) {
+		cv_wait(swapbusy_cv, swaplock);
+	}
+	lock_release(swaplock);
+}
+
+void
+SwapFree(struct PTE * pte)
+{
+	KASSERT(pte->isInMemory == false);
+	SwapSlotFree(pte->location);
+}
+
+void
+SwapSlotFree(uint32_t slot)
+{
+	lock_acquire(swaplock);
+	zswap_drop(slot);
+	SwapSlotRelease(slot);
+	lock_release(swaplock);
+}
@@ -12,110 +12,371 @@
 #include <vm.h>
 #include <mainbus.h>
 #include <synch.h>
-#include <vfs.h>
-#include <kern/fcntl.h>
-#include <uio.h>
-#include <vnode.h>
+#include <thread.h>
+#include <swap.h>
+#include <pagecache.h>
+#include <slab.h>
 
-void SwapOut(struct PTE * pte);
-void SwapIn(struct PTE * pte);
+/*
+ * Reverse map. A frame's first mapping is kept in its coremap entry,
+ * and any more, while it is shared, on a list of these.
+ */
+struct mapping {
+	struct addrspace * as;
+	vaddr_t vaddr;
+	struct mapping * next;
+};
+DECLSLAB(mapping);
+static struct mappingslab * mapping_slab = NULL;
 
 struct memunit{
-	struct thread * mu_thread;
+	struct addrspace * mu_as;	// reverse map: a page mapping
+	vaddr_t mu_vaddr;		// this frame, or NULL if none
+	struct mapping * mu_more;	// the other mappings of a shared frame
+	uint32_t mu_swapslot;	// slot holding a clean copy, or SWAP_NOSLOT
+	uint32_t mu_nextfree;	// free list links, while the block is free
+	uint32_t mu_prevfree;
 	uint16_t used : 1;
-	uint16_t next : 1;
+	uint16_t free : 1;	// first frame of a free block
 	uint16_t swapable : 1;
-	uint16_t reserve : 13;
+	uint16_t cached : 1;	// one of the references is the page cache's
+	uint16_t order : 4;	// block is 2^order frames; kept on its first frame
+	uint16_t reserve : 8;
+	uint16_t refcount;	// mappings, the page cache, or the kernel
 };
 
+/*
+ * Frames are handed out by a buddy allocator. A block of order k is
+ * 2^k frames starting at a frame index that is a multiple of 2^k, and
+ * its buddy is the block at index ^ 2^k. Each order keeps a doubly
+ * linked list of its free blocks, threaded through the coremap.
+ */
+#define BUDDY_MAXORDER	10
+#define BUDDY_NONE	((uint32_t)-1)
+
+#if KPAGES_MAX != (1 << BUDDY_MAXORDER)
+#error "KPAGES_MAX must be the largest buddy block"
+#endif
+
 struct PhysicalMemory {
-	uint32_t SwapableNumber;
-	uint32_t EmptyPageNumber;
+	uint32_t EmptyPageNumber;	// in the buddy free lists
 	uint32_t TotalPageNumber;   // [ActualMemoryByte / PageSizeByte]
 	paddr_t StartPointer;
 	struct memunit * IsMemoryUsed;
+	uint32_t FreeList[BUDDY_MAXORDER + 1];
+	uint32_t ClockHand;	// next frame SwapSomePage looks at
 };
 
 static struct PhysicalMemory * physicalmemory = NULL;
-static paddr_t lastaddr = (paddr_t)NULL;
 static struct spinlock stealmem_lock = SPINLOCK_INITIALIZER;
 static struct lock * memalloc_lock = NULL;
 
+/*
+ * coremap_lock guards what the coremap says about frames in use: their
+ * reference counts, reverse maps, swap slots and cached marks, and
+ * pageout_events. Faults and frees only need this one, and only for as
+ * long as it takes to update an entry. memalloc_lock is for the free
+ * lists, the magazine refills and drains, and the pageout clock, which
+ * takes coremap_lock as well for each frame it looks at.
+ */
+static struct spinlock coremap_lock = SPINLOCK_INITIALIZER;
+
+#define VM_MAXCPUS	32
+
+/*
+ * Per-CPU magazines of free single frames, in front of the buddy
+ * allocator. A CPU only touches its own magazine, with interrupts off,
+ * so one-page allocations normally need no lock, and frees only hold
+ * coremap_lock to clear the coremap entry. An empty magazine is
+ * refilled, and a full one drained, by MAG_SIZE/2 frames at a time
+ * under memalloc_lock.
+ *
+ * The count of swappable frames is kept per CPU as well, as a running
+ * difference; only the sum over all CPUs means anything.
+ */
+#define MAG_SIZE	16
+
+struct magazine {
+	uint32_t count;
+	uint32_t frames[MAG_SIZE];
+	int32_t swapable;
+};
+static struct magazine magazines[VM_MAXCPUS];
+
+/*
+ * Pageout daemon. It sleeps on pageout_cv (under memalloc_lock) until
+ * the number of free frames drops below pageout_low, then frees frames
+ * until there are pageout_high free again: first the zeroed pool, then
+ * cached pages nothing maps, and only then by evicting pages in use.
+ *
+ * If a pass finds nothing it can evict, it sleeps until pageout_events
+ * moves on: that counts the frames freed and the mappings recorded,
+ * the only things that can give it something to do again. Both it and
+ * pageout_waiting are kept under coremap_lock; whoever moves it on
+ * signals the thread afterwards, under memalloc_lock, if it is waiting.
+ */
+static struct cv * pageout_cv = NULL;
+static uint32_t pageout_low, pageout_high;
+static uint32_t pageout_events = 0;
+static bool pageout_waiting = false;
+
+/*
+ * Pool of frames zeroed ahead of time for alloc_kpages_zeroed. The
+ * pagezero thread tops it up when zero_sem is raised, which happens
+ * whenever the pool is found less than half full, but only
+ * while free memory is above pageout_high. Under memory pressure the
+ * pool is given back before anything is evicted, by the pageout
+ * daemon and by an allocation that finds no free frame alike.
+ */
+#define ZERO_POOL_MAX	32
+
+static struct spinlock zeropool_lock = SPINLOCK_INITIALIZER;
+static vaddr_t zeropool[ZERO_POOL_MAX];
+static unsigned zeropool_count = 0;
+static struct semaphore * zero_sem = NULL;
+
+static void ZeroThread(void * data1, unsigned long data2);
+
+/*
+ * The zero page: one frame of zeros mapped read-only, as a shared
+ * page, wherever an anonymous page is read before it is written. It
+ * is never freed or evicted and keeps no count of its sharers.
+ */
+static vaddr_t zeropage = 0;
+static bool ZeroPoolDrain(void);
+
+/*
+ * Address space IDs. Each address space gets one of the TLB_ASIDS
+ * hardware ASIDs, tagged with the generation it was handed out in, so
+ * entries of several address spaces can stay in the TLB at once. When
+ * the ASIDs run out the generation moves on and every address space
+ * gets a new one as it is next activated; a CPU flushes its TLB the
+ * first time it activates something of a newer generation.
+ *
+ * The TLB matches on the ASID in EntryHi, which tlb_read, tlb_write
+ * and tlb_probe all overwrite, so anything using them other than to
+ * write a user mapping puts the current one back with TlbRestoreAsid.
+ */
+#define TLB_ASIDS	64
+#define TLBHI_ASID(asid)	((asid) << 6)
+
+static struct spinlock asid_lock = SPINLOCK_INITIALIZER;
+static uint32_t asid_gen = 1;
+static uint32_t asid_next = 0;
+
+struct tlbstate {
+	struct addrspace * as;	// last activated on this CPU
+	uint32_t asid;		// its ASID, loaded in EntryHi
+	uint32_t gen;		// newest ASID generation in this TLB
+	unsigned hand;		// next entry WriteToTlb looks at
+};
+static struct tlbstate tlbstate[VM_MAXCPUS];
+
 static
-int
+struct tlbstate *
+TlbState(void)
+{
+	KASSERT(curcpu->c_number < VM_MAXCPUS);
+	return &tlbstate[curcpu->c_number];
+}
+
+static
+void
+TlbRestoreAsid(void)
+{
+	tlb_probe(TLBHI_ASID(TlbState()->asid), 0);
+}
+
+/*
+ * TLB replacement. A hand goes round each CPU's TLB, kept in its
+ * tlbstate and only moved with interrupts off; WriteToTlb looks at the
+ * next TLB_SCAN entries from it and takes the first invalid one. If
+ * they are all in use it evicts the one under the hand, or with
+ * TLB_PREFERCLEAN the first one that is not writable, as those are the
+ * cheapest to fault back in.
+ */
+#define TLB_SCAN	8
+#define TLB_PREFERCLEAN	1
+
+static
+void
 WriteToTlb(uint32_t ehi, uint32_t elo)
 {
 	int spl = splhigh();
-	for (uint32_t i=1; i<NUM_TLB; i++) {
+	// Replace the old mapping if there is one, e.g. after copy-on-write.
+	int idx = tlb_probe(ehi, 0);
+	if (idx >= 0) {
+		tlb_write(ehi, elo, idx);
+		splx(spl);
+		return;
+	}
+
+	struct tlbstate * st = TlbState();
+	int victim = -1, clean = -1;
+	for (unsigned k=0; k<TLB_SCAN; k++) {
+		unsigned i = (st->hand + k) % NUM_TLB;
 		uint32_t ehir, elor;
 		tlb_read(&ehir, &elor, i);
-		if (elor & TLBLO_VALID) {
-			continue;
+		if (!(elor & TLBLO_VALID)) {
+			victim = i;
+			break;
+		}
+		if (TLB_PREFERCLEAN && clean < 0 && !(elor & TLBLO_DIRTY)) {
+			clean = i;
 		}
-		//DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", faultaddress, paddr);
-		DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", ehi, elo & PAGE_FRAME);
-		tlb_write(ehi, elo, i);
-		splx(spl);
-		return 0;
 	}
+	if (victim < 0) {
+		victim = clean >= 0 ? clean : (int)st->hand;
+	}
+	st->hand = (victim + 1) % NUM_TLB;
+
+	DEBUG(DB_VM, "tpvm: 0x%x -> 0x%x\n", ehi, elo & PAGE_FRAME);
+	tlb_write(ehi, elo, victim);
 	splx(spl);
-	return -1;
 }
 
-struct swapinfo {
-	uint8_t * IsUsed;
-	size_t Empties;
-	size_t Pages;
-};
-static struct swapinfo swap;
+static
+void
+BuddyPush(uint32_t idx, unsigned order)
+{
+	struct memunit * mu = physicalmemory->IsMemoryUsed;
+	uint32_t head = physicalmemory->FreeList[order];
+	mu[idx].free = true;
+	mu[idx].order = order;
+	mu[idx].mu_prevfree = BUDDY_NONE;
+	mu[idx].mu_nextfree = head;
+	if(head != BUDDY_NONE) {
+		mu[head].mu_prevfree = idx;
+	}
+	physicalmemory->FreeList[order] = idx;
+}
+
+static
+void
+BuddyRemove(uint32_t idx, unsigned order)
+{
+	struct memunit * mu = physicalmemory->IsMemoryUsed;
+	KASSERT(mu[idx].free && mu[idx].order == order);
+	if(mu[idx].mu_prevfree != BUDDY_NONE) {
+		mu[mu[idx].mu_prevfree].mu_nextfree = mu[idx].mu_nextfree;
+	} else {
+		physicalmemory->FreeList[order] = mu[idx].mu_nextfree;
+	}
+	if(mu[idx].mu_nextfree != BUDDY_NONE) {
+		mu[mu[idx].mu_nextfree].mu_prevfree = mu[idx].mu_prevfree;
+	}
+	mu[idx].free = false;
+}
+
+/*
+ * Take a block of the given order off the free lists, splitting a
+ * larger one if needed. Returns BUDDY_NONE if there is none.
+ */
+static
+uint32_t
+BuddyAlloc(unsigned order)
+{
+	unsigned k = order;
+	while(k <= BUDDY_MAXORDER && physicalmemory->FreeList[k] == BUDDY_NONE) {
+		k++;
+	}
+	if(k > BUDDY_MAXORDER) {
+		return BUDDY_NONE;
+	}
+	uint32_t idx = physicalmemory->FreeList[k];
+	BuddyRemove(idx, k);
+	// Give back the upper halves until the block is the right size.
+	while(k > order) {
+		k--;
+		BuddyPush(idx + (1 << k), k);
+	}
+	physicalmemory->IsMemoryUsed[idx].order = order;
+	return idx;
+}
+
+/*
+ * Return a block to the free lists, merging it with its buddy for as
+ * long as the buddy is free too.
+ */
+static
+void
+BuddyFree(uint32_t idx, unsigned order)
+{
+	struct memunit * mu = physicalmemory->IsMemoryUsed;
+	while(order < BUDDY_MAXORDER) {
+		uint32_t buddy = idx ^ (1 << order);
+		if(buddy >= physicalmemory->TotalPageNumber ||
+				!mu[buddy].free || mu[buddy].order != order) {
+			break;
+		}
+		BuddyRemove(buddy, order);
+		idx &= ~(1U << order);
+		order++;
+	}
+	BuddyPush(idx, order);
+}
+
+static
+unsigned
+BuddyOrder(unsigned npages)
+{
+	unsigned order = 0;
+	while((1U << order) < npages) {
+		order++;
+	}
+	return order;
+}
 
 void
 vm_bootstrap(void)
 {
-	paddr_t addr;
-	size_t ramsize, pages, swappages;
+	paddr_t addr, firstfree;
+	size_t ramsize, pages;
 	size_t totalmemcost, totalpagecost;
 	ramsize = mainbus_ramsize();
 	pages = ramsize / PAGE_SIZE;
-	swappages = (pages + PAGE_SIZE - 1) / PAGE_SIZE;
 	size_t memoryusedcost = pages * sizeof(struct memunit);
 	totalmemcost = sizeof(struct PhysicalMemory) + memoryusedcost;
 	totalpagecost = (totalmemcost + PAGE_SIZE - 1) / PAGE_SIZE;
 	spinlock_acquire(&stealmem_lock);
 	addr = ram_stealmem(totalpagecost);
 	spinlock_release(&stealmem_lock);
-	tlb_write(addr, addr | TLBLO_DIRTY | TLBLO_VALID, 0);
-	physicalmemory = (struct PhysicalMemory*)addr;
-	physicalmemory->TotalPageNumber =
-		physicalmemory->EmptyPageNumber = pages - ((addr+PAGE_SIZE-1) / 4096) - totalpagecost;
-	physicalmemory->StartPointer = addr + (totalpagecost + swappages) * PAGE_SIZE;
-	physicalmemory->IsMemoryUsed = (struct memunit*)((char*)addr + sizeof(struct PhysicalMemory));
-	physicalmemory->SwapableNumber = 0;
+	firstfree = ram_getfirstfree();
 
-	// Init swap struct
-	swap.IsUsed = (uint8_t *)ram_stealmem(swappages);
-	swap.Empties = pages;
-	swap.Pages = pages;
+	physicalmemory = (struct PhysicalMemory*)PADDR_TO_KVADDR(addr);
+	physicalmemory->IsMemoryUsed = (struct memunit*)((char*)physicalmemory + sizeof(struct PhysicalMemory));
+	physicalmemory->StartPointer = firstfree;
+	physicalmemory->TotalPageNumber =
+		physicalmemory->EmptyPageNumber = (ramsize - firstfree) / PAGE_SIZE;
+	physicalmemory->ClockHand = 0;
 
-	lastaddr = ram_getfirstfree();
 	memset(&physicalmemory->IsMemoryUsed[0], 0, memoryusedcost);
-	memset(&swap.IsUsed[0], 0, swap.Pages);
+
+	// Carve the frames into the largest aligned blocks that fit.
+	for(unsigned k = 0; k <= BUDDY_MAXORDER; k++) {
+		physicalmemory->FreeList[k] = BUDDY_NONE;
+	}
+	for(uint32_t i = 0; i < physicalmemory->TotalPageNumber; ) {
+		unsigned k = BUDDY_MAXORDER;
+		while((i & ((1U << k) - 1)) != 0 ||
+				i + (1U << k) > physicalmemory->TotalPageNumber) {
+			k--;
+		}
+		BuddyPush(i, k);
+		i += 1U << k;
+	}
 
 	memalloc_lock = lock_create("memory_alloc_lock");
 	KASSERT(memalloc_lock != NULL);
-}
 
-static struct lock * swaplock = NULL;
-static struct vnode * swapinode;
-void
-vm_swapbootstrap()
-{
-	if(vfs_open((char*)"LHD0.img", O_RDWR, 0, &swapinode) != 0) {
-		panic("Swap boot failed!!!\n");
-	}
+	zeropage = alloc_kpages(1);
+	KASSERT(zeropage != 0);
+	bzero((void *)zeropage, PAGE_SIZE);
+
+	mapping_slab = mappingslab_create("mapping", NULL, NULL);
+	KASSERT(mapping_slab != NULL);
 
-	swaplock = lock_create("SwapLock");
-	KASSERT(swaplock != NULL);
+	pagecache_bootstrap();
 }
 
 static
@@ -138,80 +399,659 @@ tpvm_releaselock()
 	}
 }
 
+static
+struct magazine *
+MyMagazine(void)
+{
+	if(!CURCPU_EXISTS()) {
+		return &magazines[0];
+	}
+	KASSERT(curcpu->c_number < VM_MAXCPUS);
+	return &magazines[curcpu->c_number];
+}
+
+static
+void
+SwapableAdjust(int32_t delta)
+{
+	int spl = splhigh();
+	MyMagazine()->swapable += delta;
+	splx(spl);
+}
+
+static
+uint32_t
+SwapableNumber(void)
+{
+	int32_t n = 0;
+	for(unsigned c = 0; c != VM_MAXCPUS; c++) {
+		n += magazines[c].swapable;
+	}
+	return n > 0 ? n : 0;
+}
+
+static
+uint32_t
+MagazineFrames(void)
+{
+	uint32_t n = 0;
+	for(unsigned c = 0; c != VM_MAXCPUS; c++) {
+		n += magazines[c].count;
+	}
+	return n;
+}
+
+static
+void
+FrameClaim(uint32_t j)
+{
+	(physicalmemory->IsMemoryUsed[j]).mu_as = NULL;
+	(physicalmemory->IsMemoryUsed[j]).mu_vaddr = 0;
+	(physicalmemory->IsMemoryUsed[j]).mu_more = NULL;
+	(physicalmemory->IsMemoryUsed[j]).mu_swapslot = SWAP_NOSLOT;
+	(physicalmemory->IsMemoryUsed[j]).used = true;
+	(physicalmemory->IsMemoryUsed[j]).swapable = false;
+	(physicalmemory->IsMemoryUsed[j]).cached = false;
+	(physicalmemory->IsMemoryUsed[j]).refcount = 1;
+}
+
+/* Clear a frame being freed; returns the swap slot it still held. */
+static
+uint32_t
+FrameRelease(uint32_t i)
+{
+	uint32_t slot = physicalmemory->IsMemoryUsed[i].mu_swapslot;
+	if(physicalmemory->IsMemoryUsed[i].swapable) {
+		SwapableAdjust(-1);
+	}
+	physicalmemory->IsMemoryUsed[i].mu_as = NULL;
+	physicalmemory->IsMemoryUsed[i].mu_vaddr = 0;
+	KASSERT(physicalmemory->IsMemoryUsed[i].mu_more == NULL);
+	physicalmemory->IsMemoryUsed[i].mu_swapslot = SWAP_NOSLOT;
+	physicalmemory->IsMemoryUsed[i].used = false;
+	physicalmemory->IsMemoryUsed[i].swapable = false;
+	physicalmemory->IsMemoryUsed[i].cached = false;
+	physicalmemory->IsMemoryUsed[i].refcount = 0;
+	return slot;
+}
+
+/*
+ * A frame was freed or may have become evictable. coremap_lock held.
+ * Returns whether to call PageoutWake once it is let go.
+ */
+static
+bool
+PageoutEvent(void)
+{
+	pageout_events++;
+	return pageout_waiting;
+}
+
+static
+void
+PageoutWake(void)
+{
+	bool held = lock_do_i_hold(memalloc_lock);
+	if(!held) {
+		tpvm_acquirelock();
+	}
+	cv_signal(pageout_cv, memalloc_lock);
+	if(!held) {
+		tpvm_releaselock();
+	}
+}
+
+static
+void
+PageoutCheck(void)
+{
+	if(pageout_cv != NULL && physicalmemory->EmptyPageNumber < pageout_low) {
+		cv_signal(pageout_cv, memalloc_lock);
+	}
+}
+
+/* Take a frame from this CPU's magazine, refilling it if empty. */
+static
+uint32_t
+MagazineGet(void)
+{
+	int spl = splhigh();
+	struct magazine * mag = MyMagazine();
+	if(mag->count > 0) {
+		uint32_t i = mag->frames[--mag->count];
+		splx(spl);
+		return i;
+	}
+	splx(spl);
+
+	tpvm_acquirelock();
+	// We may have slept on the lock and woken up on another CPU.
+	spl = splhigh();
+	mag = MyMagazine();
+	while(mag->count < MAG_SIZE / 2) {
+		uint32_t j = BuddyAlloc(0);
+		if(j == BUDDY_NONE) {
+			break;
+		}
+		physicalmemory->EmptyPageNumber -= 1;
+		mag->frames[mag->count++] = j;
+	}
+	uint32_t i = mag->count > 0 ? mag->frames[--mag->count] : BUDDY_NONE;
+	splx(spl);
+	PageoutCheck();
+	tpvm_releaselock();
+	return i;
+}
+
+/* Put a free frame in this CPU's magazine, draining it if full. */
+static
+void
+MagazinePut(uint32_t i)
+{
+	int spl = splhigh();
+	struct magazine * mag = MyMagazine();
+	if(mag->count < MAG_SIZE) {
+		mag->frames[mag->count++] = i;
+		splx(spl);
+		return;
+	}
+	splx(spl);
+
+	tpvm_acquirelock();
+	spl = splhigh();
+	mag = MyMagazine();
+	while(mag->count > MAG_SIZE / 2) {
+		BuddyFree(mag->frames[--mag->count], 0);
+		physicalmemory->EmptyPageNumber += 1;
+	}
+	mag->frames[mag->count++] = i;
+	splx(spl);
+	tpvm_releaselock();
+}
+
 static
 void
 Find_EmptyPages(unsigned npages, size_t * idx, paddr_t * addr)
 {
 	*idx = (size_t) -1;
 	*addr = 0;
-	// get lock
-	tpvm_acquirelock();
-	if(physicalmemory->EmptyPageNumber < npages) {
-		tpvm_releaselock();
+	unsigned order = BuddyOrder(npages);
+	if(order > BUDDY_MAXORDER) {
 		return;
 	}
-	for(uint32_t i = 0; (i + npages) <= physicalmemory->TotalPageNumber; ++i) {
-		bool findit = true;
-		for(uint32_t j = i; j != i + npages; ++j) {
-			if((physicalmemory->IsMemoryUsed[j]).used == true) {
-				findit = false;
-				i = j;
-				break;
-			}
-		}
-		if(findit == true) {
+	if(order == 0) {
+		uint32_t i = MagazineGet();
+		if(i != BUDDY_NONE) {
 			*idx = i;
 			*addr = physicalmemory->StartPointer + i * PAGE_SIZE;
-			physicalmemory->EmptyPageNumber -= npages;
-			for(uint32_t j = i; j != i + npages; ++j) {
-				(physicalmemory->IsMemoryUsed[j]).mu_thread = curthread;
-				(physicalmemory->IsMemoryUsed[j]).next = true;
-				(physicalmemory->IsMemoryUsed[j]).used = true;
-			}
-			(physicalmemory->IsMemoryUsed[i + npages - 1]).next = false;
-			break;
+			physicalmemory->IsMemoryUsed[i].order = 0;
+			FrameClaim(i);
 		}
+		return;
+	}
+	// get lock
+	tpvm_acquirelock();
+	uint32_t i = BuddyAlloc(order);
+	if(i != BUDDY_NONE) {
+		*idx = i;
+		*addr = physicalmemory->StartPointer + i * PAGE_SIZE;
+		physicalmemory->EmptyPageNumber -= 1U << order;
+		for(uint32_t j = i; j != i + (1U << order); ++j) {
+			FrameClaim(j);
+		}
+		PageoutCheck();
 	}
 
 	// release lock
 	tpvm_releaselock();
 }
 
+/*
+ * Drop the entry for ADDR under ASID of generation GEN from this CPU's
+ * TLB. There can only be one if GEN is the generation the TLB holds.
+ */
 static
 void
-SwapSegment(struct Segment * seg)
+TlbDrop(uint32_t asid, uint32_t gen, vaddr_t addr)
 {
-	for(struct PteList * h = seg->ptes; h != NULL; h = h->next) {
-		SwapOut(&h->pte);
+	int spl = splhigh();
+	if(gen == TlbState()->gen) {
+		int idx = tlb_probe((addr & PAGE_FRAME) | TLBHI_ASID(asid), 0);
+		if(idx >= 0) {
+			tlb_write(TLBHI_INVALID(idx), TLBLO_INVALID(), idx);
+		}
+		TlbRestoreAsid();
 	}
+	splx(spl);
 }
 
+/* Drop the entry for ADDR in AS from this CPU's TLB. */
 static
 void
+TlbInvalidate(struct addrspace * as, vaddr_t addr)
+{
+	TlbDrop(as->asid, as->asidgen, addr);
+}
+
+/*
+ * Drop the entries for the N pages at ADDRS in AS from the TLBs of the
+ * other CPUs, and wait until they have. as->cpumask says which CPUs
+ * have activated AS; those that have flushed their TLB for a newer
+ * ASID generation since are skipped. All the pages go to each CPU in
+ * one IPI.
+ *
+ * This spins waiting for the other CPUs, so it must be called with
+ * interrupts on and no spinlocks held.
+ */
+static
+void
+TlbShootdown(struct addrspace * as, const vaddr_t * addrs, unsigned n)
+{
+	struct tlbshootdown ts[SWAP_CLUSTER];
+
+	KASSERT(n <= SWAP_CLUSTER);
+	if(!CURCPU_EXISTS() || n == 0) {
+		return;
+	}
+
+	spinlock_acquire(&asid_lock);
+	uint32_t mask = as->cpumask & ~(1U << curcpu->c_number);
+	uint32_t asid = as->asid;
+	uint32_t gen = as->asidgen;
+	spinlock_release(&asid_lock);
+	if(gen == 0) {
+		return;
+	}
+	for(unsigned c = 0; c != VM_MAXCPUS; c++) {
+		if(tlbstate[c].gen != gen) {
+			mask &= ~(1U << c);
+		}
+	}
+	if(mask == 0) {
+		return;
+	}
+
+	for(unsigned i = 0; i != n; i++) {
+		ts[i].ts_vaddr = addrs[i] & PAGE_FRAME;
+		ts[i].ts_asid = asid;
+		ts[i].ts_gen = gen;
+	}
+	ipi_tlbshootdown_mask(mask, ts, n);
+}
+
+/*
+ * Pages picked by SwapSomePage, with where they are mapped and the
+ * frames they are in.
+ */
+struct victims {
+	struct PTE * pte[SWAP_CLUSTER];
+	struct addrspace * as[SWAP_CLUSTER];
+	vaddr_t addr[SWAP_CLUSTER];
+	vaddr_t kaddr[SWAP_CLUSTER];
+	unsigned n;
+};
+
+static
+void
+VictimAdd(struct victims * v, struct PTE * pte, struct addrspace * as, vaddr_t addr)
+{
+	v->pte[v->n] = pte;
+	v->as[v->n] = as;
+	v->addr[v->n] = addr;
+	v->kaddr[v->n] = PTE_KVADDR(pte);
+	v->n++;
+}
+
+/*
+ * Drop the victims from the TLBs of the other CPUs, one shootdown for
+ * each run of them from the same address space.
+ */
+static
+void
+VictimShootdown(struct victims * v)
+{
+	for(unsigned i = 0, j; i != v->n; i = j) {
+		for(j = i + 1; j != v->n && v->as[j] == v->as[i]; j++);
+		TlbShootdown(v->as[i], &v->addr[i], j - i);
+	}
+}
+
+/*
+ * The mappings of one frame, found by SwapSomePage with their address
+ * spaces locked, and the locks it took to get there.
+ */
+struct frameusers {
+	struct PTE * pte[SWAP_CLUSTER];
+	struct addrspace * as[SWAP_CLUSTER];
+	vaddr_t addr[SWAP_CLUSTER];
+	unsigned n;
+	struct lock * locked[SWAP_CLUSTER];
+	unsigned nlocked;
+};
+
+static
+void
+FrameUnlockUsers(struct frameusers * fu)
+{
+	for(unsigned i = 0; i != fu->nlocked; i++) {
+		lock_release(fu->locked[i]);
+	}
+	fu->nlocked = 0;
+}
+
+/*
+ * Lock the address space of every mapping of frame I and find its PTE,
+ * if there are no more than MAX of them. Fails, with nothing locked,
+ * if there are too many or one of the locks is in use.
+ */
+static
+bool
+FrameLockUsers(uint32_t i, unsigned max, struct frameusers * fu)
+{
+	struct memunit * mu = &physicalmemory->IsMemoryUsed[i];
+	struct mapping * next = mu->mu_more;
+	struct addrspace * as = mu->mu_as;
+	vaddr_t addr = mu->mu_vaddr;
+
+	fu->n = fu->nlocked = 0;
+	while(true) {
+		if(fu->n == max) {
+			FrameUnlockUsers(fu);
+			return false;
+		}
+		// Also held already if the frame is mapped twice here.
+		if(!lock_do_i_hold(as->lock)) {
+			if(!lock_tryacquire(as->lock)) {
+				FrameUnlockUsers(fu);
+				return false;
+			}
+			fu->locked[fu->nlocked++] = as->lock;
+		}
+		struct PTE * pte = PageTableFind(as->pagetable, addr, false);
+		KASSERT(pte != NULL && pte->isInMemory && !pte->busy);
+		KASSERT(pte->location == (physicalmemory->StartPointer >> PTE_PAGESHIFT) + i);
+		fu->pte[fu->n] = pte;
+		fu->as[fu->n] = as;
+		fu->addr[fu->n] = addr;
+		fu->n++;
+		if(next == NULL) {
+			return true;
+		}
+		as = next->as;
+		addr = next->vaddr;
+		next = next->next;
+	}
+}
+
+/*
+ * Free some frames, picked by a clock over the coremap. Each frame's
+ * reverse map leads straight to the PTEs mapping it.
+ *
+ * useCount is raised by vm_fault every time the page is loaded into
+ * the TLB. When the hand passes a page that has been used it ages it
+ * by one and drops its TLB entry, so the next access faults and marks
+ * it again; a page is picked once it has aged to zero.
+ *
+ * A frame is only worth taking if nothing but its mappings holds it.
+ * A private page is written out if it has to be. A page shared
+ * copy-on-write is left alone, as its swap copy would have to be
+ * shared too. A frame the page cache holds has never been written to,
+ * so it is unmapped everywhere at once and the cache asked to let go
+ * of it afterwards.
+ *
+ * Up to SWAP_CLUSTER victims are collected so their swap writes can
+ * be combined. Once the first is found the hand goes at most one more
+ * time round looking for the rest. Pages that would have to be written
+ * are only taken while there are swap slots reserved for them, so with
+ * swap full, or none at all, only clean pages go.
+ *
+ * Victims are marked busy until their frames are done with, so a
+ * fault on one, or its owner exiting, waits until then; see SwapWait.
+ * Only the PTE pointers are kept once the locks are let go, and the
+ * busy mark is what keeps them, and the owners, alive.
+ *
+ * memalloc_lock is held for the whole pass, which keeps the hand to
+ * one clock at a time; coremap_lock only while looking at one frame,
+ * so faults and frees of other frames go on meanwhile.
+ *
+ * A page is only looked at with its address space's lock held, the
+ * same one vm_fault holds, so the two never change a PTE at once.
+ * The lock is only tried, as memalloc_lock is already held; pages of
+ * an address space in use are passed over this time round, unless it
+ * is this thread that holds it and is now making room. Whatever
+ * allocates with the lock held copes with its other pages going out
+ * meanwhile.
+ */
+struct clockpass {
+	struct victims clean, dirty;
+	unsigned room;                  // dirty victims there are slots for
+	unsigned uncached;              // cached frames unmapped
+	struct mapping * unmapped;      // nodes to free once unlocked
+};
+
+/*
+ * Look at frame I as the hand passes it, and take it if it can go.
+ * Returns whether it was taken. coremap_lock held.
+ */
+static
+bool
+ClockVisit(uint32_t i, struct clockpass * cp)
+{
+	struct memunit * mu = &physicalmemory->IsMemoryUsed[i];
+	if(!mu->swapable || mu->mu_as == NULL) {
+		return false;
+	}
+	unsigned nmaps = 1;
+	for(struct mapping * m = mu->mu_more; m != NULL; m = m->next) {
+		nmaps++;
+	}
+	// Evicting it would not free anything if somebody else had it too.
+	if(mu->refcount != nmaps + mu->cached || (nmaps > 1 && !mu->cached)) {
+		return false;
+	}
+	// The owners only go away once all their mappings are gone, which
+	// takes coremap_lock, so they are still there.
+	struct frameusers fu;
+	if(!FrameLockUsers(i, SWAP_CLUSTER - cp->dirty.n - cp->clean.n, &fu)) {
+		return false;
+	}
+	bool used = false;
+	for(unsigned k = 0; k != fu.n; k++) {
+		if(fu.pte[k]->useCount > 0) {
+			fu.pte[k]->useCount -= 1;
+			TlbInvalidate(fu.as[k], fu.addr[k]);
+			used = true;
+		}
+	}
+	if(used) {
+		FrameUnlockUsers(&fu);
+		return false;
+	}
+
+	// A private page has the one mapping.
+	struct PTE * pte = fu.pte[0];
+	bool readonly = mu->cached || !pte->writeable;
+	bool inswap = !pte->dirty && mu->mu_swapslot != SWAP_NOSLOT;
+	if(!readonly && !inswap && cp->dirty.n == cp->room) {
+		// Would need a swap slot, and there is none for it.
+		FrameUnlockUsers(&fu);
+		return false;
+	}
+
+	// Taken: drop the mappings so the hand skips it from now on.
+	while(mu->mu_more != NULL) {
+		struct mapping * m = mu->mu_more;
+		mu->mu_more = m->next;
+		m->next = cp->unmapped;
+		cp->unmapped = m;
+	}
+	mu->mu_as = NULL;
+	mu->mu_vaddr = 0;
+	if(mu->cached) {
+		cp->uncached++;
+	}
+	for(unsigned k = 0; k != fu.n; k++) {
+		pte = fu.pte[k];
+		if(pte->readahead) {
+			// Read in ahead of time and never touched.
+			pte->readahead = false;
+			swap_readahead_miss();
+		}
+		TlbInvalidate(fu.as[k], fu.addr[k]);
+		pte->busy = true;
+		if(readonly) {
+			// Read-only and cached pages cannot have changed since
+			// they were loaded, so the next fault can just load
+			// them again.
+			VictimAdd(&cp->clean, pte, fu.as[k], fu.addr[k]);
+			pte->valid = false;
+			pte->isInMemory = false;
+		} else if(inswap) {
+			// Unchanged since it was read from swap; the copy there
+			// is still good, so hand the slot back to it.
+			VictimAdd(&cp->clean, pte, fu.as[k], fu.addr[k]);
+			pte->isInMemory = false;
+			pte->location = mu->mu_swapslot;
+			mu->mu_swapslot = SWAP_NOSLOT;
+		} else {
+			KASSERT(mu->mu_swapslot == SWAP_NOSLOT);
+			VictimAdd(&cp->dirty, pte, fu.as[k], fu.addr[k]);
+		}
+	}
+	FrameUnlockUsers(&fu);
+	return true;
+}
+
+static
+bool
 SwapSomePage()
 {
-	KASSERT(physicalmemory->SwapableNumber > 0);
-	for(uint32_t i = 0; i != physicalmemory->TotalPageNumber; ++i) {
+	struct clockpass cp;
+	cp.clean.n = cp.dirty.n = 0;
+	cp.room = swap_reserve(SWAP_CLUSTER);
+	cp.uncached = 0;
+	cp.unmapped = NULL;
+
+	// Enough steps to age every page from PTE_USEMAX down to zero.
+	uint32_t steps = physicalmemory->TotalPageNumber * (PTE_USEMAX + 1);
+	tpvm_acquirelock();
+	while(steps-- > 0 && cp.dirty.n + cp.clean.n != SWAP_CLUSTER) {
+		uint32_t i = physicalmemory->ClockHand;
+		physicalmemory->ClockHand = (i + 1) % physicalmemory->TotalPageNumber;
+		spinlock_acquire(&coremap_lock);
+		bool taken = ClockVisit(i, &cp);
+		spinlock_release(&coremap_lock);
+		if(taken && steps > physicalmemory->TotalPageNumber) {
+			steps = physicalmemory->TotalPageNumber;
+		}
+	}
+	tpvm_releaselock();
+	swap_unreserve(cp.room - cp.dirty.n);
+
+	// No CPU may keep using a victim once its frame is written out or
+	// reused.
+	VictimShootdown(&cp.clean);
+	VictimShootdown(&cp.dirty);
+
+	while(cp.unmapped != NULL) {
+		struct mapping * m = cp.unmapped;
+		cp.unmapped = m->next;
+		mappingslab_free(mapping_slab, m);
+	}
+
+	SwapWake(cp.clean.pte, cp.clean.n);
+	for(unsigned i = 0; i != cp.clean.n; i++) {
+		free_kpages(cp.clean.kaddr[i]);
+	}
+	// Cached frames are left with just the cache's reference.
+	if(cp.uncached > 0) {
+		pagecache_reclaim(cp.uncached);
+	}
+	if(cp.dirty.n > 0) {
+		SwapOutCluster(cp.dirty.pte, cp.dirty.n);
+		// Once more, in case a fault mapped one again during the write.
+		VictimShootdown(&cp.dirty);
+		SwapWake(cp.dirty.pte, cp.dirty.n);
+		for(unsigned i = 0; i != cp.dirty.n; i++) {
+			free_kpages(cp.dirty.kaddr[i]);
+		}
+	}
+	return cp.dirty.n + cp.clean.n > 0;
+}
+
+static
+void
+PageoutThread(void * data1, unsigned long data2)
+{
+	(void)data1;
+	(void)data2;
+	while(true) {
 		tpvm_acquirelock();
-		bool swapable = physicalmemory->IsMemoryUsed[i].swapable == true;
-		struct proc * proc = physicalmemory->IsMemoryUsed[i].mu_thread->t_proc;
+		while(physicalmemory->EmptyPageNumber >= pageout_low) {
+			cv_wait(pageout_cv, memalloc_lock);
+		}
 		tpvm_releaselock();
-		if(swapable) {
-			SwapSegment(&proc->p_addrspace->code);
-			SwapSegment(&proc->p_addrspace->data);
-			SwapSegment(&proc->p_addrspace->heap);
-			SwapSegment(&proc->p_addrspace->stack);
-			break;
+
+		while(true) {
+			uint32_t empty = physicalmemory->EmptyPageNumber;
+			if(empty >= pageout_high) {
+				break;
+			}
+			uint32_t seen = pageout_events;
+			// Cheapest first: nobody is using these.
+			if(ZeroPoolDrain() || pagecache_reclaim(pageout_high - empty)) {
+				continue;
+			}
+			if(SwapableNumber() == 0 || !SwapSomePage()) {
+				// Everything is shared, busy or in use. Going round
+				// again would find the same, so wait for a change.
+				tpvm_acquirelock();
+				spinlock_acquire(&coremap_lock);
+				pageout_waiting = true;
+				while(pageout_events == seen) {
+					spinlock_release(&coremap_lock);
+					cv_wait(pageout_cv, memalloc_lock);
+					spinlock_acquire(&coremap_lock);
+				}
+				pageout_waiting = false;
+				spinlock_release(&coremap_lock);
+				tpvm_releaselock();
+				break;
+			}
 		}
 	}
 }
 
+void
+vm_pageoutbootstrap(void)
+{
+	pageout_low = physicalmemory->TotalPageNumber / 32 + 1;
+	pageout_high = physicalmemory->TotalPageNumber / 16 + SWAP_CLUSTER;
+
+	pageout_cv = cv_create("pageout");
+	KASSERT(pageout_cv != NULL);
+	if(thread_fork("pageout", NULL, PageoutThread, NULL, 0) != 0) {
+		panic("Couldn't start pageout thread\n");
+	}
+
+	zero_sem = sem_create("pagezero", 1);
+	KASSERT(zero_sem != NULL);
+	if(thread_fork("pagezero", NULL, ZeroThread, NULL, 0) != 0) {
+		panic("Couldn't start pagezero thread\n");
+	}
+
+	pagecache_threadbootstrap();
+}
+
 static
 void
-SwapInSegment(struct Segment * seg)
+SwapInSegment(struct PageTable * pt, struct Segment * seg)
 {
-	for(struct PteList * h = seg->ptes; h != NULL; h = h->next) {
-		SwapIn(&h->pte);
+	for(vaddr_t addr = seg->start; addr < seg->start + seg->bound; addr += PAGE_SIZE) {
+		struct PTE * pte = PageTableFind(pt, addr, false);
+		if(pte != NULL && pte->valid) {
+			SwapIn(pte);
+		}
 	}
 }
 
@@ -222,45 +1062,146 @@ SwapInPages()
 	if(curthread == NULL) {
 		return;
 	}
-	struct proc * proc = curthread->t_proc;
-	SwapInSegment(&proc->p_addrspace->code);
-	SwapInSegment(&proc->p_addrspace->data);
-	SwapInSegment(&proc->p_addrspace->heap);
-	SwapInSegment(&proc->p_addrspace->stack);
+	struct addrspace * as = curthread->t_proc->p_addrspace;
+	SwapInSegment(as->pagetable, &as->code);
+	SwapInSegment(as->pagetable, &as->data);
+	SwapInSegment(as->pagetable, &as->heap);
+	SwapInSegment(as->pagetable, &as->stack);
 }
 
+static
 vaddr_t
-alloc_kpages_swapable(unsigned npages)
+AllocSwapable(unsigned npages, bool evict)
 {
 	paddr_t pa;
 	size_t idx;
 	Find_EmptyPages(npages, &idx, &pa);
-	if(pa == 0) {
-		SwapSomePage();
+	if(evict && pa == 0 && (ZeroPoolDrain() || pagecache_reclaim(npages))) {
+		Find_EmptyPages(npages, &idx, &pa);
+	}
+	while(evict && pa == 0 && SwapableNumber() > 0 && SwapSomePage()) {
 		Find_EmptyPages(npages, &idx, &pa);
-		KASSERT(pa != 0);
+	}
+	if(pa == 0) {
+		return 0;
 	}
 	KASSERT(idx != (size_t)-1);
 	for(size_t i = idx; i != idx + npages; i++) {
 		physicalmemory->IsMemoryUsed[i].swapable = true;
 	}
-	tpvm_acquirelock();
-	physicalmemory->SwapableNumber += npages;
-	tpvm_releaselock();
+	SwapableAdjust(npages);
 
 	return PADDR_TO_KVADDR(pa);
 }
+
+vaddr_t
+alloc_kpages_swapable(unsigned npages)
+{
+	return AllocSwapable(npages, true);
+}
+
+vaddr_t
+alloc_kpages_swapable_noevict(unsigned npages)
+{
+	return AllocSwapable(npages, false);
+}
+
+vaddr_t
+alloc_kpages_zeroed(void)
+{
+	vaddr_t kaddr = 0;
+	spinlock_acquire(&zeropool_lock);
+	if(zeropool_count > 0) {
+		kaddr = zeropool[--zeropool_count];
+	}
+	bool low = zeropool_count < ZERO_POOL_MAX / 2;
+	spinlock_release(&zeropool_lock);
+	if(low && zero_sem != NULL) {
+		V(zero_sem);
+	}
+
+	if(kaddr == 0) {
+		kaddr = alloc_kpages_swapable(1);
+		if(kaddr == 0) {
+			return 0;
+		}
+		bzero((void *)kaddr, PAGE_SIZE);
+	}
+	return kaddr;
+}
+
+/* Give the zeroed pool back to the allocator. */
+static
+bool
+ZeroPoolDrain(void)
+{
+	bool freed = false;
+	while(true) {
+		vaddr_t kaddr = 0;
+		spinlock_acquire(&zeropool_lock);
+		if(zeropool_count > 0) {
+			kaddr = zeropool[--zeropool_count];
+		}
+		spinlock_release(&zeropool_lock);
+		if(kaddr == 0) {
+			return freed;
+		}
+		free_kpages(kaddr);
+		freed = true;
+	}
+}
+
+static
+void
+ZeroThread(void * data1, unsigned long data2)
+{
+	(void)data1;
+	(void)data2;
+	while(true) {
+		P(zero_sem);
+		while(zeropool_count < ZERO_POOL_MAX &&
+				physicalmemory->EmptyPageNumber > pageout_high) {
+			vaddr_t kaddr = alloc_kpages_swapable_noevict(1);
+			if(kaddr == 0) {
+				break;
+			}
+			bzero((void *)kaddr, PAGE_SIZE);
+
+			spinlock_acquire(&zeropool_lock);
+			bool full = zeropool_count == ZERO_POOL_MAX;
+			if(!full) {
+				zeropool[zeropool_count++] = kaddr;
+			}
+			spinlock_release(&zeropool_lock);
+			if(full) {
+				free_kpages(kaddr);
+				break;
+			}
+			// Only soaks up time nobody else wants.
+			thread_yield();
+		}
+	}
+}
+
 /* Allocate/free some kernel-space virtual pages */
 vaddr_t
 alloc_kpages(unsigned npages)
 {
 	paddr_t pa;
 	size_t idx;
+	if(npages > KPAGES_MAX) {
+		// No amount of reclaiming or swapping makes such a block.
+		return 0;
+	}
 	Find_EmptyPages(npages, &idx, &pa);
-	if(pa == 0) {
-		SwapSomePage();
+	if(pa == 0 && (ZeroPoolDrain() || pagecache_reclaim(npages))) {
 		Find_EmptyPages(npages, &idx, &pa);
-		KASSERT(pa != 0);
+	}
+	while(pa == 0 && SwapableNumber() > 0 && SwapSomePage()) {
+		Find_EmptyPages(npages, &idx, &pa);
+	}
+	if(pa == 0) {
+		return 0;
 	}
 	KASSERT(idx != (size_t)-1);
 	for(size_t i = idx; i != idx + npages; i++) {
@@ -270,133 +1211,358 @@ alloc_kpages(unsigned npages)
 	return PADDR_TO_KVADDR(pa);
 }
 
+static
+uint32_t
+coremap_index(vaddr_t addr)
+{
+	uint32_t index = ((addr - MIPS_KSEG0) - physicalmemory->StartPointer) / PAGE_SIZE;
+	KASSERT(index < physicalmemory->TotalPageNumber);
+	return index;
+}
+
+static
+bool
+MappingIs(struct addrspace * mas, vaddr_t mvaddr, struct addrspace * as, vaddr_t vaddr)
+{
+	return mas == as && mvaddr == vaddr;
+}
+
+/* Whether the page at VADDR in AS is in the reverse map of MU. */
+static
+bool
+MappingFind(struct memunit * mu, struct addrspace * as, vaddr_t vaddr)
+{
+	if(MappingIs(mu->mu_as, mu->mu_vaddr, as, vaddr)) {
+		return true;
+	}
+	for(struct mapping * m = mu->mu_more; m != NULL; m = m->next) {
+		if(MappingIs(m->as, m->vaddr, as, vaddr)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/*
+ * Take the page at VADDR in AS out of the reverse map of MU, if it is
+ * there. If that leaves one mapping, it is in the coremap entry.
+ * Returns a node to free once coremap_lock is let go, or NULL.
+ */
+static
+struct mapping *
+MappingRemove(struct memunit * mu, struct addrspace * as, vaddr_t vaddr)
+{
+	struct mapping * m;
+	if(MappingIs(mu->mu_as, mu->mu_vaddr, as, vaddr)) {
+		m = mu->mu_more;
+		if(m == NULL) {
+			mu->mu_as = NULL;
+			mu->mu_vaddr = 0;
+			return NULL;
+		}
+		mu->mu_as = m->as;
+		mu->mu_vaddr = m->vaddr;
+		mu->mu_more = m->next;
+		return m;
+	}
+	for(struct mapping ** pp = &mu->mu_more; *pp != NULL; pp = &(*pp)->next) {
+		m = *pp;
+		if(MappingIs(m->as, m->vaddr, as, vaddr)) {
+			*pp = m->next;
+			return m;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Drop a reference to the frame at ADDR, and with it the mapping at
+ * VADDR in AS unless AS is NULL.
+ */
+static
+void
+FramePut(vaddr_t addr, struct addrspace * as, vaddr_t vaddr)
+{
+	if(addr == zeropage) {
+		return;
+	}
+	uint32_t index = coremap_index(addr);
+	struct memunit * mu = &physicalmemory->IsMemoryUsed[index];
+	KASSERT(mu->used && !mu->free);
+	// The coremap entry is cleared under the lock even for the last
+	// reference: SwapSomePage follows mu_as into the owner's page
+	// table, and may only do that while the frame is still its.
+	spinlock_acquire(&coremap_lock);
+	struct mapping * m = NULL;
+	if(as != NULL) {
+		m = MappingRemove(mu, as, vaddr & PAGE_FRAME);
+	}
+	bool wake = PageoutEvent();
+	if(mu->refcount > 1) {
+		// Somebody else still has it.
+		mu->refcount -= 1;
+		spinlock_release(&coremap_lock);
+		if(wake) {
+			PageoutWake();
+		}
+		if(m != NULL) {
+			mappingslab_free(mapping_slab, m);
+		}
+		return;
+	}
+	KASSERT(m == NULL);
+	uint32_t slot = mu->mu_swapslot;
+	unsigned order = mu->order;
+	for(uint32_t i = index; i != index + (1U << order); i++) {
+		FrameRelease(i);
+	}
+	spinlock_release(&coremap_lock);
+	if(order == 0) {
+		// Single frames go back through the magazine, which takes
+		// memalloc_lock itself if it has to drain.
+		MagazinePut(index);
+	} else {
+		tpvm_acquirelock();
+		physicalmemory->EmptyPageNumber += 1U << order;
+		BuddyFree(index, order);
+		tpvm_releaselock();
+	}
+	if(wake) {
+		PageoutWake();
+	}
+
+	// The page is gone, so its copy in swap is no use either.
+	if(slot != SWAP_NOSLOT) {
+		SwapSlotFree(slot);
+	}
+}
+
 void
 free_kpages(vaddr_t addr)
 {
-	/* nothing - leak the memory. */
-	tpvm_acquirelock();
-	uint32_t index = ((addr - MIPS_KSEG0) - physicalmemory->StartPointer) / PAGE_SIZE;
-	if(index > physicalmemory->TotalPageNumber) {
-		KASSERT(index < physicalmemory->TotalPageNumber);
+	FramePut(addr, NULL, 0);
+}
+
+void
+coremap_share(vaddr_t addr)
+{
+	if(addr == zeropage) {
+		return;
 	}
-	for(; index < (uint32_t)physicalmemory->TotalPageNumber; index ++) {
-		bool last = physicalmemory->IsMemoryUsed[index].next == false;
-		bool swapable = physicalmemory->IsMemoryUsed[index].swapable == true;
-		bzero(&physicalmemory->IsMemoryUsed[index], sizeof(typeof(*physicalmemory->IsMemoryUsed)));
-		if(swapable) {
-			physicalmemory->SwapableNumber -= 1;
+	spinlock_acquire(&coremap_lock);
+	uint32_t index = coremap_index(addr);
+	KASSERT(physicalmemory->IsMemoryUsed[index].used);
+	physicalmemory->IsMemoryUsed[index].refcount += 1;
+	spinlock_release(&coremap_lock);
+}
+
+void
+coremap_map(vaddr_t addr, struct addrspace * as, vaddr_t vaddr)
+{
+	if(addr == zeropage) {
+		return;
+	}
+	vaddr &= PAGE_FRAME;
+	struct mapping * m = NULL;
+	bool wake = false;
+	while(true) {
+		spinlock_acquire(&coremap_lock);
+		struct memunit * mu = &physicalmemory->IsMemoryUsed[coremap_index(addr)];
+		KASSERT(mu->used);
+		if(MappingFind(mu, as, vaddr)) {
+			break;
 		}
-		physicalmemory->EmptyPageNumber += 1;
-		if(last) {
+		if(mu->mu_as == NULL) {
+			mu->mu_as = as;
+			mu->mu_vaddr = vaddr;
+			wake = PageoutEvent();
+			break;
+		}
+		if(m != NULL) {
+			m->as = as;
+			m->vaddr = vaddr;
+			m->next = mu->mu_more;
+			mu->mu_more = m;
+			m = NULL;
 			break;
 		}
+		// A second mapping needs a node, and getting one may have to
+		// allocate, which cannot be done under a spinlock.
+		spinlock_release(&coremap_lock);
+		m = mappingslab_alloc(mapping_slab);
+		if(m == NULL) {
+			// Left out of the reverse map, so the frame just never
+			// gets an owner again.
+			return;
+		}
 	}
-	tpvm_releaselock();
+	spinlock_release(&coremap_lock);
+	if(wake) {
+		PageoutWake();
+	}
+	if(m != NULL) {
+		mappingslab_free(mapping_slab, m);
+	}
+}
+
+void
+coremap_unmap(vaddr_t addr, struct addrspace * as, vaddr_t vaddr)
+{
+	FramePut(addr, as, vaddr);
+}
+
+void
+coremap_setslot(vaddr_t addr, uint32_t slot)
+{
+	spinlock_acquire(&coremap_lock);
+	uint32_t index = coremap_index(addr);
+	KASSERT(physicalmemory->IsMemoryUsed[index].used);
+	KASSERT(physicalmemory->IsMemoryUsed[index].mu_swapslot == SWAP_NOSLOT);
+	physicalmemory->IsMemoryUsed[index].mu_swapslot = slot;
+	spinlock_release(&coremap_lock);
+}
+
+void
+coremap_setcached(vaddr_t addr, bool cached)
+{
+	spinlock_acquire(&coremap_lock);
+	uint32_t index = coremap_index(addr);
+	KASSERT(physicalmemory->IsMemoryUsed[index].used);
+	physicalmemory->IsMemoryUsed[index].cached = cached;
+	spinlock_release(&coremap_lock);
+}
+
+uint32_t
+coremap_takeslot(vaddr_t addr)
+{
+	uint32_t slot;
+	spinlock_acquire(&coremap_lock);
+	uint32_t index = coremap_index(addr);
+	slot = physicalmemory->IsMemoryUsed[index].mu_swapslot;
+	physicalmemory->IsMemoryUsed[index].mu_swapslot = SWAP_NOSLOT;
+	spinlock_release(&coremap_lock);
+	return slot;
+}
+
+unsigned
+coremap_sharecount(vaddr_t addr)
+{
+	unsigned count;
+	if(addr == zeropage) {
+		// Always somebody else's.
+		return (unsigned)-1;
+	}
+	spinlock_acquire(&coremap_lock);
+	count = physicalmemory->IsMemoryUsed[coremap_index(addr)].refcount;
+	spinlock_release(&coremap_lock);
+	return count;
+}
+
+vaddr_t
+coremap_zeropage(void)
+{
+	return zeropage;
 }
 
 unsigned
 int
 coremap_used_bytes() {
-	return (physicalmemory->TotalPageNumber - physicalmemory->EmptyPageNumber) * PAGE_SIZE;
+	return (physicalmemory->TotalPageNumber - physicalmemory->EmptyPageNumber -
+		MagazineFrames()) * PAGE_SIZE;
+}
+
+void
+vm_tlbflush(void)
+{
+	int spl = splhigh();
+
+	for (int i=0; i<NUM_TLB; i++) {
+		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
+	}
+	TlbRestoreAsid();
+
+	splx(spl);
 }
 
 void
 vm_tlbshootdown(const struct tlbshootdown *ts)
 {
-	(void)ts;
-	panic("vm tried to do tlb shootdown?!\n");
+	if(TLBSHOOTDOWN_ALL(ts)) {
+		vm_tlbflush();
+	} else {
+		TlbDrop(ts->ts_asid, ts->ts_gen, ts->ts_vaddr);
+	}
 }
 
 int
 vm_fault(int faulttype, vaddr_t faultaddress)
 {
-    (void)faulttype;
-    (void)faultaddress;
-
 	faultaddress &= PAGE_FRAME;
 
-	if(faultaddress < (vaddr_t)lastaddr) {
-		uint32_t ehi, elo;
-		ehi = faultaddress;
-		elo = faultaddress | TLBLO_DIRTY | TLBLO_VALID;
-		if(WriteToTlb(ehi, elo) == 0) {
-			return 0;
-		}
-		return EFAULT;
-	}
-
 	struct addrspace * as = proc_getas();
 	if(as == NULL) {
 		return EFAULT;
 	}
 	
-	struct PTE * pte = as_pagefault(as, faultaddress);
-	if(pte == NULL) {
-		return EFAULT;
+	lock_acquire(as->lock);
+	struct PTE * pte;
+	int result = as_pagefault(as, faultaddress, faulttype, &pte);
+	if(result) {
+		lock_release(as->lock);
+		return result;
 	}
-	paddr_t paddr = pte->physical;
-	if(WriteToTlb((uint32_t)faultaddress, (uint32_t)(paddr | TLBLO_DIRTY | TLBLO_VALID)) == 0) {
-		return 0;
+	// The write may have moved the page to a new frame (copy-on-write)
+	// and other CPUs may still map the old one.
+	if(faulttype == VM_FAULT_READONLY) {
+		TlbShootdown(as, &faultaddress, 1);
 	}
-
-	if(curproc == NULL) {
-		return EFAULT;
+	// Referenced again; see SwapSomePage.
+	if(pte->useCount < PTE_USEMAX) {
+		pte->useCount += 1;
 	}
-	return EFAULT;
-}
-
-void
-SwapIn(struct PTE * pte)
-{
-	if(pte->isInMemory == true) {
-		return;
-	}
-	size_t pos = pte->virtual;
-	size_t idx = pos / PAGE_SIZE;
-	pte->virtual = alloc_kpages(1);
-
-	struct iovec iov;
-	struct uio ku;
-	int err = 0;
-	lock_acquire(swaplock);
-	uio_kinit(&iov, &ku, (void*)pte->virtual, PAGE_SIZE, pos, UIO_READ);
-	err = VOP_READ(swapinode, &ku);
-
-	swap.IsUsed[idx] = 0;
-	pte->isInMemory = true;
-	lock_release(swaplock);
-
-	if(err) {
-		KASSERT(err != 0);
+	// Shared pages are mapped read-only so the first write faults
+	// and gets its own copy.
+	uint32_t elo = PTE_PADDR(pte) | TLBLO_VALID;
+	// Clean pages are mapped read-only as well, so the first write
+	// faults and marks them dirty.
+	if(pte->writeable && !pte->shared && pte->dirty) {
+		elo |= TLBLO_DIRTY;
 	}
+	WriteToTlb((uint32_t)faultaddress | TLBHI_ASID(TlbState()->asid), elo);
+	lock_release(as->lock);
+	return 0;
 }
 
+static
 void
-SwapOut(struct PTE * pte)
+AsActivate(struct addrspace * as)
 {
-	struct iovec iov;
-	struct uio ku;
-	uint64_t pos = (uint64_t)-1;
-	int err;
-	lock_acquire(swaplock);
-	for(size_t i = 0; i != swap.Pages; i++) {
-		if(swap.IsUsed[i] == 0) {
-			pos = i * PAGE_SIZE;
-			swap.IsUsed[i] = 1;
-			break;
+	int spl = splhigh();
+	struct tlbstate * st = TlbState();
+
+	spinlock_acquire(&asid_lock);
+	if(as->asidgen != asid_gen) {
+		if(asid_next == TLB_ASIDS) {
+			asid_gen++;
+			asid_next = 0;
 		}
+		as->asid = asid_next++;
+		as->asidgen = asid_gen;
 	}
-	KASSERT(pos != (uint64_t)-1);
-	uio_kinit(&iov, &ku, (void*)pte->virtual, PAGE_SIZE, pos, UIO_WRITE);
-	err = VOP_WRITE(swapinode, &ku);
+	uint32_t gen = asid_gen;
+	as->cpumask |= 1U << curcpu->c_number;
+	spinlock_release(&asid_lock);
 
-	pte->isInMemory = false;
-	pte->virtual = pos;
-	lock_release(swaplock);
-	free_kpages(pte->virtual);
-	if(err) {
-		KASSERT(err != 0);
+	// Same address space, or one whose ASID this TLB already knows:
+	// its entries are still good, so there is nothing to flush.
+	if(st->gen != gen) {
+		vm_tlbflush();
+		st->gen = gen;
 	}
+	st->as = as;
+	st->asid = as->asid;
+	TlbRestoreAsid();
+	splx(spl);
 }
 
 void
@@ -416,16 +1582,23 @@ as_activate(void)
 	/*
 	 * Write this.
 	 */
-	int spl = splhigh();
-
-	for (int i=1; i<NUM_TLB; i++) {
-		tlb_write(TLBHI_INVALID(i), TLBLO_INVALID(), i);
-	}
-
-	splx(spl);
+	AsActivate(as);
 
 	// SwapIn while as_complete_load() has ran.
 	if(false) {
 		SwapInPages();
 	}
-}
\ No newline at end of file
+}
+
+void
+vm_tlbflush_as(struct addrspace * as)
+{
+	// Retire the ASID: entries tagged with it are never matched again.
+	spinlock_acquire(&asid_lock);
+	as->asidgen = 0;
+	as->cpumask = 0;
+	spinlock_release(&asid_lock);
+	if(TlbState()->as == as) {
+		AsActivate(as);
+	}
+}
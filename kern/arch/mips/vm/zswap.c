@@ -0,0 +1,426 @@
+#include <types.h>
+#include <lib.h>
+#include <mainbus.h>
+#include <vm.h>
+#include <zswap.h>
+
+/*
+ * The pool is carved into chunks of ZSWAP_CHUNK bytes, and each page in
+ * it takes a run of chunks big enough for its compressed form. Runs are
+ * found next-fit from a cursor, with one bit per chunk marking it used.
+ * Pages are spilled oldest first. The pool is one block of memory, so
+ * it is never bigger than KPAGES_MAX pages; with no pool at all,
+ * nothing is compressed.
+ */
+#define ZSWAP_RAMFRACTION   16          // pool is this fraction of RAM
+#define ZSWAP_CHUNK         64
+#define ZSWAP_PERPAGE       8           // entries per page of pool
+#define ZSWAP_MAXSIZE       (PAGE_SIZE * 3 / 4)
+#define ZSWAP_BUCKETS       256
+
+struct zentry {
+	uint32_t slot;
+	uint32_t chunk;
+	uint32_t size;
+	struct zentry * hnext;          // same hash bucket
+	struct zentry * prev, * next;   // age order, oldest first
+};
+
+static struct zpool {
+	uint8_t * Base;
+	uint32_t * ChunkMap;
+	size_t Chunks;
+	size_t Cursor;
+	struct zentry * FreeEntries;
+	struct zentry * Oldest, * Newest;
+	struct zentry * Buckets[ZSWAP_BUCKETS];
+} zpool;
+
+static uint8_t zscratch[ZSWAP_MAXSIZE];
+static size_t zscratchlen;
+static uint8_t zspill[PAGE_SIZE];
+
+/*
+ * LZ77 codec for whole pages, in the style of LZ4. A block is a run of
+ * sequences, each a token byte, some literal bytes, and then a match:
+ * a two byte little-endian offset back into the output and a length.
+ * The high nibble of the token is the literal count and the low one
+ * the match length less LZ_MINMATCH; a nibble of 15 is followed by
+ * extra length bytes, each added in, ending at the first below 255.
+ * The last sequence has literals only.
+ */
+#define LZ_MINMATCH     4
+#define LZ_HASHBITS     10
+#define LZ_TABLESIZE    (1 << LZ_HASHBITS)
+
+static uint16_t lz_table[LZ_TABLESIZE];
+
+static
+uint32_t
+LzRead32(const uint8_t * p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static
+unsigned
+LzHash(uint32_t v)
+{
+	return (v * 2654435761U) >> (32 - LZ_HASHBITS);
+}
+
+static
+size_t
+LzPutLength(uint8_t * dst, size_t op, size_t len)
+{
+	if(len < 15) {
+		return op;
+	}
+	len -= 15;
+	while(len >= 255) {
+		dst[op++] = 255;
+		len -= 255;
+	}
+	dst[op++] = (uint8_t)len;
+	return op;
+}
+
+static
+size_t
+LzGetLength(const uint8_t * src, size_t ip, size_t * len)
+{
+	uint8_t b;
+	do {
+		b = src[ip++];
+		*len += b;
+	} while(b == 255);
+	return ip;
+}
+
+/*
+ * Append a sequence of NLIT literals from LIT and a match of MLEN bytes
+ * OFFSET back, or no match if MLEN is 0. Returns the new output length,
+ * or 0 if it would not fit in CAP.
+ */
+static
+size_t
+LzEmit(uint8_t * dst, size_t op, size_t cap, const uint8_t * lit, size_t nlit,
+		size_t offset, size_t mlen)
+{
+	if(op + 1 + nlit / 255 + 1 + nlit + 2 + mlen / 255 + 1 > cap) {
+		return 0;
+	}
+	size_t ml = mlen == 0 ? 0 : mlen - LZ_MINMATCH;
+	dst[op++] = (uint8_t)((MIN(nlit, 15) << 4) | MIN(ml, 15));
+	op = LzPutLength(dst, op, nlit);
+	memcpy(&dst[op], lit, nlit);
+	op += nlit;
+	if(mlen != 0) {
+		dst[op++] = offset & 0xff;
+		dst[op++] = offset >> 8;
+		op = LzPutLength(dst, op, ml);
+	}
+	return op;
+}
+
+/*
+ * Returns the compressed size, or 0 if it would not fit in CAP. TABLE,
+ * of LZ_TABLESIZE entries, is scratch space.
+ */
+static
+size_t
+LzCompress(const uint8_t * src, uint8_t * dst, size_t cap, uint16_t * table)
+{
+	size_t ip = 0, anchor = 0, op = 0;
+
+	bzero(table, LZ_TABLESIZE * sizeof(uint16_t));
+	while(ip + LZ_MINMATCH <= PAGE_SIZE) {
+		uint32_t v = LzRead32(src + ip);
+		unsigned h = LzHash(v);
+		size_t cand = table[h];
+		table[h] = (uint16_t)ip;
+		if(cand >= ip || LzRead32(src + cand) != v) {
+			ip++;
+			continue;
+		}
+		size_t mlen = LZ_MINMATCH;
+		while(ip + mlen < PAGE_SIZE && src[cand + mlen] == src[ip + mlen]) {
+			mlen++;
+		}
+		op = LzEmit(dst, op, cap, src + anchor, ip - anchor, ip - cand, mlen);
+		if(op == 0) {
+			return 0;
+		}
+		ip += mlen;
+		anchor = ip;
+	}
+	return LzEmit(dst, op, cap, src + anchor, PAGE_SIZE - anchor, 0, 0);
+}
+
+static
+void
+LzDecompress(const uint8_t * src, size_t len, uint8_t * dst)
+{
+	size_t ip = 0, op = 0;
+	for(;;) {
+		KASSERT(ip < len);
+		uint8_t token = src[ip++];
+		size_t nlit = token >> 4;
+		if(nlit == 15) {
+			ip = LzGetLength(src, ip, &nlit);
+		}
+		KASSERT(ip + nlit <= len && op + nlit <= PAGE_SIZE);
+		memcpy(&dst[op], &src[ip], nlit);
+		ip += nlit;
+		op += nlit;
+		if(ip == len) {
+			break;
+		}
+
+		size_t offset = src[ip] | ((size_t)src[ip + 1] << 8);
+		ip += 2;
+		size_t mlen = token & 15;
+		if(mlen == 15) {
+			ip = LzGetLength(src, ip, &mlen);
+		}
+		mlen += LZ_MINMATCH;
+		KASSERT(offset != 0 && offset <= op && op + mlen <= PAGE_SIZE);
+		// Byte by byte: the match may overlap what it produces.
+		for(size_t i = 0; i != mlen; i++, op++) {
+			dst[op] = dst[op - offset];
+		}
+	}
+	KASSERT(op == PAGE_SIZE);
+}
+
+static
+bool
+ChunkIsUsed(size_t idx)
+{
+	return (zpool.ChunkMap[idx / 32] & (1U << (idx % 32))) != 0;
+}
+
+static
+void
+ChunkMark(size_t idx, size_t n, bool used)
+{
+	for(size_t i = idx; i != idx + n; i++) {
+		if(used) {
+			zpool.ChunkMap[i / 32] |= 1U << (i % 32);
+		} else {
+			zpool.ChunkMap[i / 32] &= ~(1U << (i % 32));
+		}
+	}
+}
+
+/* Returns the first of N free chunks in a row, or (size_t)-1. */
+static
+size_t
+ChunkAlloc(size_t n)
+{
+	size_t start = zpool.Cursor;
+	for(unsigned pass = 0; pass != 2; pass++) {
+		// The second pass also covers runs that straddle the cursor.
+		size_t i = pass == 0 ? start : 0;
+		size_t end = pass == 0 ? zpool.Chunks : MIN(start + n - 1, zpool.Chunks);
+		size_t run = 0;
+		for(; i < end; i++) {
+			if(ChunkIsUsed(i)) {
+				run = 0;
+				continue;
+			}
+			if(++run == n) {
+				size_t first = i + 1 - n;
+				ChunkMark(first, n, true);
+				zpool.Cursor = (i + 1) % zpool.Chunks;
+				return first;
+			}
+		}
+	}
+	return (size_t)-1;
+}
+
+static
+struct zentry **
+EntryBucket(uint32_t slot)
+{
+	return &zpool.Buckets[(slot * 2654435761U) % ZSWAP_BUCKETS];
+}
+
+static
+struct zentry *
+EntryFind(uint32_t slot)
+{
+	struct zentry * e = *EntryBucket(slot);
+	while(e != NULL && e->slot != slot) {
+		e = e->hnext;
+	}
+	return e;
+}
+
+static
+void
+EntryRemove(struct zentry * e)
+{
+	struct zentry ** pp = EntryBucket(e->slot);
+	while(*pp != e) {
+		pp = &(*pp)->hnext;
+	}
+	*pp = e->hnext;
+
+	if(e->prev != NULL) {
+		e->prev->next = e->next;
+	} else {
+		zpool.Oldest = e->next;
+	}
+	if(e->next != NULL) {
+		e->next->prev = e->prev;
+	} else {
+		zpool.Newest = e->prev;
+	}
+
+	ChunkMark(e->chunk, DIVROUNDUP(e->size, ZSWAP_CHUNK), false);
+	e->next = zpool.FreeEntries;
+	zpool.FreeEntries = e;
+}
+
+void
+zswap_bootstrap(void)
+{
+	size_t pages = mainbus_ramsize() / PAGE_SIZE / ZSWAP_RAMFRACTION;
+	pages = MIN(MAX(pages, 1), KPAGES_MAX);
+	zpool.Chunks = pages * PAGE_SIZE / ZSWAP_CHUNK;
+	zpool.Cursor = 0;
+	zpool.FreeEntries = NULL;
+	zpool.Oldest = zpool.Newest = NULL;
+	for(unsigned i = 0; i != ZSWAP_BUCKETS; i++) {
+		zpool.Buckets[i] = NULL;
+	}
+
+	size_t words = DIVROUNDUP(zpool.Chunks, 32);
+	size_t nentries = pages * ZSWAP_PERPAGE;
+	zpool.Base = kmalloc(pages * PAGE_SIZE);
+	zpool.ChunkMap = kmalloc(words * sizeof(uint32_t));
+	struct zentry * entries = kmalloc(nentries * sizeof(struct zentry));
+	if(zpool.Base == NULL || zpool.ChunkMap == NULL || entries == NULL) {
+		kprintf("zswap: no memory for a %u page pool, not compressing\n",
+				(unsigned)pages);
+		kfree(zpool.Base);
+		kfree(zpool.ChunkMap);
+		kfree(entries);
+		zpool.Base = NULL;
+		zpool.ChunkMap = NULL;
+		return;
+	}
+	bzero(zpool.ChunkMap, words * sizeof(uint32_t));
+
+	for(size_t i = 0; i != nentries; i++) {
+		entries[i].next = zpool.FreeEntries;
+		zpool.FreeEntries = &entries[i];
+	}
+}
+
+size_t
+zswap_compress(const void * page)
+{
+	if(zpool.Base == NULL) {
+		return 0;
+	}
+	zscratchlen = LzCompress(page, zscratch, sizeof(zscratch), lz_table);
+	return zscratchlen;
+}
+
+size_t
+zswap_encode(const void * page, void * dst, size_t cap)
+{
+	// Not lz_table: that one belongs to whoever holds the swap lock.
+	uint16_t * table = kmalloc(LZ_TABLESIZE * sizeof(uint16_t));
+	if(table == NULL) {
+		return 0;
+	}
+	size_t len = LzCompress(page, dst, cap, table);
+	kfree(table);
+	return len;
+}
+
+void
+zswap_decode(const void * src, size_t len, void * page)
+{
+	LzDecompress(src, len, page);
+}
+
+bool
+zswap_store(uint32_t slot)
+{
+	KASSERT(zscratchlen != 0);
+	KASSERT(EntryFind(slot) == NULL);
+	if(zpool.FreeEntries == NULL) {
+		return false;
+	}
+	size_t chunk = ChunkAlloc(DIVROUNDUP(zscratchlen, ZSWAP_CHUNK));
+	if(chunk == (size_t)-1) {
+		return false;
+	}
+	memcpy(zpool.Base + chunk * ZSWAP_CHUNK, zscratch, zscratchlen);
+
+	struct zentry * e = zpool.FreeEntries;
+	zpool.FreeEntries = e->next;
+	e->slot = slot;
+	e->chunk = chunk;
+	e->size = zscratchlen;
+
+	struct zentry ** bucket = EntryBucket(slot);
+	e->hnext = *bucket;
+	*bucket = e;
+	e->prev = zpool.Newest;
+	e->next = NULL;
+	if(zpool.Newest != NULL) {
+		zpool.Newest->next = e;
+	} else {
+		zpool.Oldest = e;
+	}
+	zpool.Newest = e;
+	return true;
+}
+
+const void *
+zswap_evict(uint32_t * slot)
+{
+	struct zentry * e = zpool.Oldest;
+	if(e == NULL) {
+		return NULL;
+	}
+	LzDecompress(zpool.Base + e->chunk * ZSWAP_CHUNK, e->size, zspill);
+	*slot = e->slot;
+	EntryRemove(e);
+	return zspill;
+}
+
+bool
+zswap_load(uint32_t slot, void * page)
+{
+	struct zentry * e = EntryFind(slot);
+	if(e == NULL) {
+		return false;
+	}
+	LzDecompress(zpool.Base + e->chunk * ZSWAP_CHUNK, e->size, page);
+	EntryRemove(e);
+	return true;
+}
+
+bool
+zswap_contains(uint32_t slot)
+{
+	return EntryFind(slot) != NULL;
+}
+
+void
+zswap_drop(uint32_t slot)
+{
+	struct zentry * e = EntryFind(slot);
+	if(e != NULL) {
+		EntryRemove(e);
+	}
+}
@@ -12,10 +12,49 @@
 #include <kern/seek.h>
 #include <kern/stat.h>
 #include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <slab.h>
+#include <pagecache.h>
 
 #define FILES_STRUCT_DEFAULT_CAPACITY 3
 void files_struct_ensurespace(struct files_struct * files, uint32_t sz, bool has_lock);
 
+// struct file comes from a slab; its locks are made once per object.
+DECLSLAB(file);
+static struct fileslab * file_slab;
+
+static int FileCtor(void * obj)
+{
+    struct file * fp = obj;
+
+    fp->lock = rwlock_create("file");
+    if(fp->lock == NULL) {
+        return ENOMEM;
+    }
+    fp->reflock = lock_create("file");
+    if(fp->reflock == NULL) {
+        rwlock_destroy(fp->lock);
+        return ENOMEM;
+    }
+    return 0;
+}
+
+static void FileDtor(void * obj)
+{
+    struct file * fp = obj;
+
+    lock_destroy(fp->reflock);
+    rwlock_destroy(fp->lock);
+}
+
+void file_bootstrap(void)
+{
+    file_slab = fileslab_create("file", FileCtor, FileDtor);
+    if(file_slab == NULL) {
+        panic("slab_create for file failed\n");
+    }
+}
+
 struct files_struct * files_struct_create(char* name)
 {
     struct files_struct * files;
@@ -234,32 +273,21 @@ struct file* file_create(char* path, int flags, int mode)
     char buf[256];
     struct file * fp = NULL;
 
-    fp = kmalloc(sizeof(*fp));
+    fp = fileslab_alloc(file_slab);
     if(fp == NULL) {
         return NULL;
     }
 
-    fp->lock = rwlock_create(path);
-    if(fp->lock == NULL) {
-        kfree(fp);
-        return NULL;
-    }
-
-    fp->reflock = lock_create(path);
-    if(fp->reflock == NULL) {
-        rwlock_destroy(fp->lock);
-        kfree(fp);
-        return NULL;
-    }
-
     strcpy(buf, path);
     int err = vfs_open(buf, flags, mode, &fp->inode);
     if (err) {
-        lock_destroy(fp->reflock);
-        rwlock_destroy(fp->lock);
-        kfree(fp);
+        fileslab_free(file_slab, fp);
         return NULL;
     }
+    if (flags & O_TRUNC) {
+        // Cached pages of the old contents must not be mapped again.
+        pagecache_purge(fp->inode);
+    }
 
     fp->flags = flags;
     fp->mode = mode;
@@ -276,10 +304,8 @@ void file_destroy(struct file* fp)
     if(file_decref(fp, false) != 0) {
         return;
     }
-    rwlock_destroy(fp->lock);
-    lock_destroy(fp->reflock);
     vfs_close(fp->inode);
-    kfree(fp);
+    fileslab_free(file_slab, fp);
 }
 
 uint32_t file_addref(struct file* fp, bool has_lock)
@@ -376,6 +402,8 @@ ssize_t file_write(struct file* fp, const void* buf, size_t N, uint64_t * pos)
 
 	uio_kinit(&iov, &ku, kbuf, N, *pos, UIO_WRITE);
     err = VOP_WRITE(fp->inode, &ku);
+    // Even a failed write may have changed part of the file.
+    pagecache_purge(fp->inode);
 	if(err) {
 		kprintf("Write error:[%s]\n", strerror(err));
         rwlock_release_write(fp->lock);
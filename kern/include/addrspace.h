@@ -36,39 +36,54 @@
 
 
 #include <vm.h>
+#include <pagetable.h>
 #include "opt-dumbvm.h"
 
 struct vnode;
+struct lock;
 
-struct PTE {
-    uint32_t swapable : 1;
-    uint32_t shared : 1;
-    uint32_t valid : 1;
-    uint32_t readable : 1;
-    uint32_t writeable : 1;
-    uint32_t executable : 1;
-    uint32_t isInMemory : 1;
-    uint32_t reserved : 5;
-    uint32_t location : 20;     // physical page number
-    paddr_t physical;         // recalcuated
-    vaddr_t virtual;
-    uint32_t useCount;
-    pid_t pid;
-};
-
-struct PteList {
-    struct PTE pte;
-    struct PteList * prev;
-    struct PteList * next;
-};
-
+/*
+ * A contiguous range of the address space with one set of permissions.
+ * The pages themselves live in the address space's page table.
+ *
+ * Segments loaded from an executable also remember where their data
+ * is in the file: the FILESIZE bytes starting at address FILESTART
+ * come from OFFSET in VNODE, everything else is zero-filled.
+ */
 struct Segment {
-    struct PteList * ptes;
     vaddr_t start;
     size_t bound;
+    bool readable;
+    bool writeable;
+    bool executable;
+    struct vnode * vnode;
+    off_t offset;
+    vaddr_t filestart;
+    size_t filesize;
+    bool writeback;     /* shared file mapping: written back on munmap */
 };
 
 
+/*
+ * The stack grows down on demand to at most STACK_MAXPAGES pages. A
+ * fault below it grows it only if at least STACK_GUARDPAGES unmapped
+ * pages would remain between it and the segment below.
+ */
+#define STACK_MAXPAGES      1024
+#define STACK_GUARDPAGES    16
+
+/*
+ * The heap may grow up to HEAP_TOP, which leaves room below it for
+ * the largest stack plus its guard gap.
+ */
+#define HEAP_TOP            (USERSTACK - (STACK_MAXPAGES + STACK_GUARDPAGES) * PAGE_SIZE)
+
+/*
+ * Regions made by mmap. They are placed top down from HEAP_TOP, and
+ * the heap cannot grow into them. A slot with bound 0 is unused.
+ */
+#define AS_MAXMAPS          16
+
 /*
  * Address space - data structure associated with the virtual memory
  * space of a process.
@@ -87,11 +102,30 @@ struct addrspace {
         paddr_t as_stackpbase;
 #else
         /* Put stuff here for your VM system */
+        struct PageTable * pagetable;
+        struct lock * lock;             /* held to change the page table */
         struct Segment code, data, heap, stack;
+        struct Segment maps[AS_MAXMAPS];
+        uint32_t asid, asidgen;         /* TLB address space ID; see tpvm.c */
+        uint32_t cpumask;               /* CPUs that have activated it */
 #endif
 };
 
-struct PTE * as_pagefault(struct addrspace * as, vaddr_t addr);
+/*
+ * Find the PTE backing ADDR for vm_fault and put it in *RET, bringing
+ * the page into memory first. A write to a copy-on-write page
+ * (FAULTTYPE is VM_FAULT_READONLY) gives the page its own frame.
+ * Fails with EFAULT if the access is not allowed, or ENOMEM if there
+ * is no memory for the page.
+ *
+ * The caller holds as->lock, and keeps holding it until the TLB entry
+ * is written. The pageout clock takes the same lock before it looks at
+ * a PTE, so a page cannot be evicted between being found here and
+ * being mapped, and everything else that changes the page table holds
+ * it too.
+ */
+int as_pagefault(struct addrspace * as, vaddr_t addr, int faulttype,
+                 struct PTE ** ret);
 
 /*
  * Functions in addrspace.c:
@@ -123,6 +157,11 @@ struct PTE * as_pagefault(struct addrspace * as, vaddr_t addr);
  *    as_prepare_load - this is called before actually loading from an
  *                executable into the address space.
  *
+ *    as_define_file - back the region containing VADDR with FILESIZE
+ *                bytes of V starting at OFFSET. The pages are read
+ *                when first touched, and the address space holds a
+ *                reference to V until it is destroyed.
+ *
  *    as_complete_load - this is called when loading from an executable
  *                is complete.
  *
@@ -130,6 +169,20 @@ struct PTE * as_pagefault(struct addrspace * as, vaddr_t addr);
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
  *
+ *    as_sbrk   - move the end of the heap by AMOUNT bytes and hand
+ *                back where it was. Pages past a lowered break are
+ *                freed; new ones are zero-filled on first touch.
+ *
+ *    as_mmap   - map LEN bytes at ADDR if that range is free, or
+ *                wherever there is room otherwise, and hand back the
+ *                address used. With VN set, the first FILESIZE bytes
+ *                come from OFFSET in VN and the rest are zeros; with
+ *                WRITEBACK set as well, they are written back to VN
+ *                when unmapped. Pages are only loaded when touched.
+ *
+ *    as_munmap - remove every mapped page in the LEN bytes at ADDR,
+ *                writing back file pages first where needed.
+ *
  * Note that when using dumbvm, addrspace.c is not used and these
  * functions are found in dumbvm.c.
  */
@@ -146,8 +199,17 @@ int               as_define_region(struct addrspace *as,
                                    int writeable,
                                    int executable);
 int               as_prepare_load(struct addrspace *as);
+int               as_define_file(struct addrspace *as, vaddr_t vaddr,
+                                 struct vnode *v, off_t offset,
+                                 size_t filesize);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
+int               as_sbrk(struct addrspace *as, intptr_t amount,
+                          vaddr_t *oldbreak);
+int               as_mmap(struct addrspace *as, vaddr_t addr, size_t len,
+                          int prot, struct vnode *vn, off_t offset,
+                          size_t filesize, bool writeback, vaddr_t *ret);
+int               as_munmap(struct addrspace *as, vaddr_t addr, size_t len);
 
 
 /*
@@ -48,6 +48,9 @@ struct file* files_struct_get(struct files_struct * files, size_t fd);
 //inline 
 void files_struct_set(struct files_struct * files, size_t fd, struct file * file);
 
+// set up the struct file cache; called from boot()
+void file_bootstrap(void);
+
 struct file* file_create(char* path, int flags, int mode);
 void file_destroy(struct file* fp);
 
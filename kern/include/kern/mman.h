@@ -0,0 +1,23 @@
+#ifndef _KERN_MMAN_H_
+#define _KERN_MMAN_H_
+
+/*
+ * Constants for mmap, shared between kernel and userland.
+ */
+
+/* Page protection, for the PROT argument */
+#define PROT_NONE       0
+#define PROT_READ       1
+#define PROT_WRITE      2
+#define PROT_EXEC       4
+
+/* Mapping type, for the FLAGS argument; exactly one must be given */
+#define MAP_SHARED      0x0001  /* writes go back to the file */
+#define MAP_PRIVATE     0x0002  /* writes stay in this process */
+
+/* Other flags */
+#define MAP_ANON        0x1000  /* zero-filled memory, no file */
+
+#define MAP_FAILED      ((void *)-1)
+
+#endif /* _KERN_MMAN_H_ */
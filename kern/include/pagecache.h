@@ -0,0 +1,44 @@
+#ifndef _PAGECACHE_H_
+#define _PAGECACHE_H_
+
+#include <types.h>
+
+struct vnode;
+
+/*
+ * Cache of read-only pages loaded from files, so every process running
+ * the same executable maps the same frames for its text.
+ *
+ * A page is named by its vnode and the file offset it starts at, and
+ * holds the PAGE_SIZE bytes of the file from there; pages that are
+ * partly file data and partly zeros are not cached, as where the zeros
+ * start depends on who maps them. The cache keeps one reference to
+ * each frame with coremap_share, marked with coremap_setcached, and
+ * one to each vnode.
+ * The pageout clock may unmap a cached frame from everything using it;
+ * it then asks the cache to let go of that many pages.
+ *
+ *    pagecache_bootstrap - set up the cache; called from vm_bootstrap.
+ *    pagecache_lookup    - return the cached frame for the page with a
+ *                          new reference taken for the caller, or 0.
+ *    pagecache_insert    - offer the loaded frame KADDR for the page.
+ *                          Returns the frame to map, with a reference
+ *                          for the caller: KADDR, or an already cached
+ *                          frame if another thread got there first, in
+ *                          which case KADDR has been freed.
+ *    pagecache_threadbootstrap - start the thread that lets go of the
+ *                          vnodes of reclaimed pages.
+ *    pagecache_reclaim   - free up to WANT cached pages nothing maps any
+ *                          more. Returns true if any were freed. Safe to
+ *                          call while allocating.
+ *    pagecache_purge     - forget every cached page of VN, e.g. after
+ *                          its file has been written or truncated.
+ */
+void    pagecache_bootstrap(void);
+void    pagecache_threadbootstrap(void);
+vaddr_t pagecache_lookup(struct vnode * vn, off_t offset);
+vaddr_t pagecache_insert(struct vnode * vn, off_t offset, vaddr_t kaddr);
+bool    pagecache_reclaim(unsigned want);
+void    pagecache_purge(struct vnode * vn);
+
+#endif /* _PAGECACHE_H_ */
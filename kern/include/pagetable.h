@@ -0,0 +1,68 @@
+#ifndef _PAGETABLE_H_
+#define _PAGETABLE_H_
+
+#include <types.h>
+#include <vm.h>
+
+/*
+ * Page table entry. Kept to a single word so a leaf of the page table
+ * fits in one page.
+ *
+ * While the page is in memory, location is its physical page number;
+ * once it has been swapped out, location is the swap slot instead.
+ */
+struct PTE {
+    uint32_t busy : 1;          // picked by the pageout path; see SwapWait
+    uint32_t shared : 1;
+    uint32_t valid : 1;
+    uint32_t readable : 1;
+    uint32_t writeable : 1;
+    uint32_t filedirty : 1;     // written since it was read from its file
+    uint32_t isInMemory : 1;
+    uint32_t useCount : 3;
+    uint32_t readahead : 1;     // swapped in early, not touched yet
+    uint32_t dirty : 1;         // written since it was last read from swap
+    uint32_t location : 20;     // physical page number or swap slot
+};
+
+#define PTE_USEMAX          7           // useCount saturates here
+#define PTE_PAGESHIFT       12
+#define PTE_PADDR(pte)      ((paddr_t)(pte)->location << PTE_PAGESHIFT)
+#define PTE_KVADDR(pte)     PADDR_TO_KVADDR(PTE_PADDR(pte))
+#define KVADDR_TO_PPN(kva)  (((kva) - MIPS_KSEG0) >> PTE_PAGESHIFT)
+
+/*
+ * Two-level page table.
+ *
+ * The top 10 bits of a user address select a leaf from the directory,
+ * the next 10 bits select the PTE within that leaf. The directory only
+ * has to cover kuseg, and each leaf is exactly one page of PTEs. Leaves
+ * are allocated the first time an entry inside them is asked for.
+ */
+#define PT_LEAFBITS         10
+#define PT_LEAFSIZE         (1 << PT_LEAFBITS)
+#define PT_DIRSIZE          (USERSPACETOP >> (PTE_PAGESHIFT + PT_LEAFBITS))
+#define PT_DIRINDEX(va)     ((va) >> (PTE_PAGESHIFT + PT_LEAFBITS))
+#define PT_LEAFINDEX(va)    (((va) >> PTE_PAGESHIFT) & (PT_LEAFSIZE - 1))
+
+struct PageTable {
+    struct PTE * leaves[PT_DIRSIZE];
+};
+
+/*
+ *    PageTableCreate  - allocate an empty page table.
+ *    PageTableDestroy - free the directory and all leaves. The frames
+ *                       the entries point at must be released first.
+ *    PageTableFind    - return the PTE for ADDR. If its leaf does not
+ *                       exist yet it is allocated when CREATE is set,
+ *                       otherwise NULL is returned.
+ *    PageTableNext    - the first address from ADDR up to END whose leaf
+ *                       exists, or END. Lets a walk over a range skip
+ *                       the parts that never had a page.
+ */
+struct PageTable * PageTableCreate(void);
+void               PageTableDestroy(struct PageTable * pt);
+struct PTE *       PageTableFind(struct PageTable * pt, vaddr_t addr, bool create);
+vaddr_t            PageTableNext(struct PageTable * pt, vaddr_t addr, vaddr_t end);
+
+#endif /* _PAGETABLE_H_ */
@@ -0,0 +1,58 @@
+#ifndef _SLAB_H_
+#define _SLAB_H_
+
+#include <types.h>
+
+/*
+ * Object caches for kernel structures of one fixed size that are
+ * allocated and freed all the time.
+ *
+ * Objects are carved out of single-page slabs, aligned to SLAB_ALIGN
+ * so no two share a cache line. An optional constructor runs once for
+ * each object when its slab is made, and the destructor when the slab
+ * is given back; in between, freed objects keep their constructed
+ * state, so locks and the like inside them are reused as they are.
+ * Each CPU keeps a few free objects of its own, so most allocations
+ * and frees take no lock at all.
+ *
+ *    slab_create  - make a cache of SIZE-byte objects. CTOR returns 0,
+ *                   or an error if the object could not be set up.
+ *                   Either function may be NULL. Returns NULL if out
+ *                   of memory.
+ *    slab_alloc   - get an object, or NULL if out of memory.
+ *    slab_free    - give back an object, constructed state intact.
+ */
+#define SLAB_ALIGN  32
+
+struct slab_cache;
+
+struct slab_cache * slab_create(const char * name, size_t size,
+                                int (*ctor)(void *), void (*dtor)(void *));
+void *              slab_alloc(struct slab_cache * sc);
+void                slab_free(struct slab_cache * sc, void * obj);
+
+/*
+ * Typed wrappers: DECLSLAB(foo) declares struct fooslab, a cache of
+ * struct foo, with fooslab_create, fooslab_alloc and fooslab_free.
+ */
+#define DECLSLAB_BYTYPE(SLAB, T) \
+	struct SLAB; \
+	static inline struct SLAB * \
+	SLAB##_create(const char * name, int (*ctor)(void *), void (*dtor)(void *)) \
+	{ \
+		return (struct SLAB *)slab_create(name, sizeof(T), ctor, dtor); \
+	} \
+	static inline T * \
+	SLAB##_alloc(struct SLAB * s) \
+	{ \
+		return slab_alloc((struct slab_cache *)s); \
+	} \
+	static inline void \
+	SLAB##_free(struct SLAB * s, T * obj) \
+	{ \
+		slab_free((struct slab_cache *)s, obj); \
+	}
+
+#define DECLSLAB(T) DECLSLAB_BYTYPE(T##slab, struct T)
+
+#endif /* _SLAB_H_ */
@@ -0,0 +1,79 @@
+#ifndef _SWAP_H_
+#define _SWAP_H_
+
+#include <types.h>
+#include <vm.h>
+
+struct PTE;
+
+/*
+ * Move one user page between memory and the swap device. Pages go
+ * out through SwapOutCluster, below.
+ *
+ *    SwapIn  - read the page back into a new frame. The slot stays
+ *              with the frame as a clean copy; see coremap_setslot.
+ *              Fails with ENOMEM if there is no frame for it.
+ *    SwapFree - drop the swap slot of a page that is not in memory.
+ */
+int SwapIn(struct PTE * pte);
+void SwapFree(struct PTE * pte);
+
+/* Release a swap slot that no page refers to any more */
+#define SWAP_NOSLOT ((uint32_t)-1)
+void SwapSlotFree(uint32_t slot);
+
+/*
+ * Swap out up to SWAP_CLUSTER pages at once. They are given slots next
+ * to each other where possible and written with as few writes as that
+ * allows.
+ *
+ * The pageout path marks a page busy, under memalloc_lock, from when
+ * it picks it until it is done with its frame; nobody else may change
+ * or free a busy PTE. SwapOutCluster takes busy PTES and points them
+ * at their slots, leaving them busy and their frames to the caller.
+ *
+ *    SwapWake - clear busy on the N PTES and wake their waiters.
+ *    SwapWait - sleep until PTE is not busy. Called before looking at
+ *               a PTE the pageout path may have picked.
+ */
+#define SWAP_CLUSTER 8
+void SwapOutCluster(struct PTE ** ptes, unsigned n);
+void SwapWake(struct PTE ** ptes, unsigned n);
+void SwapWait(struct PTE * pte);
+
+/*
+ * Swap in the page at ADDR in AS, along with the pages after it (below
+ * LIMIT) that sit in the following swap slots, in one read. How many
+ * extra pages are read adapts to how many of them turn out to be used:
+ * the caller reports each readahead page as a hit when it is first
+ * faulted on, or as a miss when it is evicted untouched. Fails with
+ * ENOMEM if there is no frame for the page itself.
+ */
+struct addrspace;
+int SwapInCluster(struct addrspace * as, vaddr_t addr, vaddr_t limit);
+void swap_readahead_hit(void);
+void swap_readahead_miss(void);
+
+/*
+ * Swap space accounting, in slots of one page each.
+ *
+ *    swap_reserve   - set aside up to WANT free slots for SwapOutCluster
+ *                     and return how many; 0 if there is no swap.
+ *    swap_unreserve - give back N reserved slots that were not used.
+ */
+unsigned swap_reserve(unsigned want);
+void swap_unreserve(unsigned n);
+size_t swap_freeslots(void);
+size_t swap_usedslots(void);
+
+/*
+ * Swap devices. vm_swapbootstrap adds LHD0.img and LHD1.img, whichever
+ * can be opened; more can be added while running.
+ *
+ *    swap_adddev - start swapping to the file or device PATH as well.
+ *    cmd_swapon  - the "swapon" menu command, wrapping swap_adddev.
+ */
+int swap_adddev(const char * path);
+int cmd_swapon(int nargs, char ** args);
+
+#endif /* _SWAP_H_ */
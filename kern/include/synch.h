@@ -100,6 +100,12 @@ void lock_acquire(struct lock *);
 void lock_release(struct lock *);
 bool lock_do_i_hold(struct lock *);
 
+/*
+ * Get the lock only if nobody holds it, without waiting. Returns true
+ * if it was taken.
+ */
+bool lock_tryacquire(struct lock *);
+
 
 /*
  * Condition variable.
@@ -47,6 +47,9 @@ void syscall(struct trapframe *tf);
 /* Helper for fork(). You write this. */
 void enter_forked_process(struct trapframe *tf);
 
+/* Set up the allocator for fork()'s hand-off to the child; called from boot(). */
+void fork_bootstrap(void);
+
 /* Enter user mode. Does not return. */
 __DEAD void enter_new_process(int argc, userptr_t argv, userptr_t env,
 		       vaddr_t stackptr, vaddr_t entrypoint);
@@ -69,5 +72,8 @@ int sys_close(int fd);
 ssize_t sys_read(int fs, void* buf, size_t N);
 ssize_t sys_write(int fd, const void * buf, size_t N);
 off_t sys_lseek(int fd, off_t offset, int pos);
+void * sys_sbrk(intptr_t amount);
+void * sys_mmap(void * addr, size_t len, int prot, int flags, int fd, off_t offset);
+int sys_munmap(void * addr, size_t len);
 
 #endif /* _SYSCALL_H_ */
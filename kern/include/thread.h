@@ -184,4 +184,13 @@ void thread_wait_for_count(unsigned);
 
 void thread_collect(struct proc * proc, struct threadlist *tl);
 
+/*
+ * Send the N TLB shootdowns at MAPPINGS to every CPU in MASK, one bit
+ * per c_number, and wait until they have all been done. Lives next to
+ * ipi_tlbshootdown in thread.c, which owns the list of CPUs.
+ */
+struct tlbshootdown;
+void ipi_tlbshootdown_mask(uint32_t mask, const struct tlbshootdown *mappings,
+                           unsigned n);
+
 #endif /* _THREAD_H_ */
@@ -0,0 +1,134 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#ifndef _VM_H_
+#define _VM_H_
+
+/*
+ * VM system-related definitions.
+ *
+ * You'll probably want to add stuff here.
+ */
+
+
+#include <machine/vm.h>
+
+/* Fault-type arguments to vm_fault() */
+#define VM_FAULT_READ        0    /* A read was attempted */
+#define VM_FAULT_WRITE       1    /* A write was attempted */
+#define VM_FAULT_READONLY    2    /* A write to a readonly page was attempted*/
+
+
+/* Initialization function */
+void vm_bootstrap(void);
+
+/* Open the swap device; needs the VFS, so it runs late in boot */
+void vm_swapbootstrap(void);
+
+/* Start the pageout and page-zeroing threads; called by vm_swapbootstrap */
+void vm_pageoutbootstrap(void);
+
+/* Fault handling function called by trap code */
+int vm_fault(int faulttype, vaddr_t faultaddress);
+
+/* Allocate/free kernel heap pages (called by kmalloc/kfree) */
+vaddr_t alloc_kpages(unsigned npages);
+void free_kpages(vaddr_t addr);
+
+/* Most pages alloc_kpages can hand out in one block */
+#define KPAGES_MAX	1024
+
+/* Allocate pages for user memory; these may be paged out. 0 if none */
+vaddr_t alloc_kpages_swapable(unsigned npages);
+
+/* Same, but return 0 rather than evict anything to make room */
+vaddr_t alloc_kpages_swapable_noevict(unsigned npages);
+
+/* One swappable page, already zeroed; usually from a pre-zeroed pool */
+vaddr_t alloc_kpages_zeroed(void);
+
+/*
+ * Frames shared copy-on-write between address spaces. coremap_share
+ * adds a reference to the frame at kernel address ADDR; free_kpages
+ * drops one and only releases the frame with the last reference.
+ */
+void coremap_share(vaddr_t addr);
+unsigned coremap_sharecount(vaddr_t addr);
+
+/*
+ * Kernel address of the shared zero page. Sharing and freeing it are
+ * no-ops, and it always counts as shared with someone else.
+ */
+vaddr_t coremap_zeropage(void);
+
+/*
+ * Reverse map. coremap_map records that the page at VADDR in AS maps
+ * the frame at kernel address ADDR, with a reference the caller already
+ * holds; recording it again does nothing. coremap_unmap forgets it and
+ * drops that reference, as free_kpages. A frame is only considered for
+ * eviction while its one reference is a recorded mapping, which it
+ * becomes again once all its other sharers have unmapped it.
+ */
+struct addrspace;
+void coremap_map(vaddr_t addr, struct addrspace * as, vaddr_t vaddr);
+void coremap_unmap(vaddr_t addr, struct addrspace * as, vaddr_t vaddr);
+
+/*
+ * Mark whether the page cache holds a reference to the frame at ADDR.
+ * Such a frame is never written to, so the pageout clock may unmap it
+ * from every address space at once and leave the cache to free it.
+ */
+void coremap_setcached(vaddr_t addr, bool cached);
+
+/*
+ * Swap cache. A page read back from swap keeps its slot, recorded on
+ * the frame with coremap_setslot, for as long as it stays clean; if it
+ * is evicted again before being written to, the copy in swap is reused
+ * without any I/O. coremap_takeslot detaches and returns the slot
+ * (SWAP_NOSLOT if none). Freeing the frame releases the slot.
+ */
+void coremap_setslot(vaddr_t addr, uint32_t slot);
+uint32_t coremap_takeslot(vaddr_t addr);
+
+/*
+ * Return amount of memory (in bytes) used by allocator
+ * Should only be accessed by test161 tests
+ */
+unsigned int coremap_used_bytes(void);
+
+/* Invalidate every user mapping in this CPU's TLB */
+void vm_tlbflush(void);
+
+/* Invalidate every mapping of AS, in the TLBs of all CPUs */
+void vm_tlbflush_as(struct addrspace * as);
+
+/* TLB shootdown handling called from interprocessor_interrupt */
+void vm_tlbshootdown(const struct tlbshootdown *);
+
+#endif /* _VM_H_ */
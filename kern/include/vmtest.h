@@ -0,0 +1,26 @@
+#ifndef _VMTEST_H_
+#define _VMTEST_H_
+
+#include "opt-zswap.h"
+
+/*
+ * Kernel menu tests of the VM system, in test/vmtest.c. These live
+ * here rather than in test.h so the VM can be moved around as a unit.
+ *
+ *    buddytest - allocate and free kernel pages in blocks of assorted
+ *                sizes and check they are aligned, disjoint, and all
+ *                given back.
+ *    slabtest  - allocate objects over several slabs of a cache and
+ *                check they are aligned, disjoint and constructed,
+ *                free them, and allocate them again.
+ *    zswaptest - round-trip pages of assorted contents through the
+ *                zswap codec.
+ */
+int buddytest(int nargs, char **args);
+int slabtest(int nargs, char **args);
+
+#if OPT_ZSWAP
+int zswaptest(int nargs, char **args);
+#endif
+
+#endif /* _VMTEST_H_ */
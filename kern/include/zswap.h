@@ -0,0 +1,63 @@
+#ifndef _ZSWAP_H_
+#define _ZSWAP_H_
+
+#include <types.h>
+#include "opt-zswap.h"
+
+/*
+ * Compressed swap cache, kept in front of the swap device.
+ *
+ * A page being swapped out still gets a swap slot, but if it
+ * compresses well its contents are kept, compressed, in a fixed pool
+ * of memory instead of being written to the slot. When the pool is
+ * full the oldest pages are spilled to their slots on disk. A slot
+ * therefore holds its page either in the pool or on disk, never both
+ * out of date.
+ *
+ * All of these are called with the swap lock held.
+ *
+ *    zswap_bootstrap - set aside the pool, or leave compression off if
+ *                      there is no memory for it; called from
+ *                      vm_swapbootstrap.
+ *    zswap_compress  - compress PAGE into a scratch buffer. Returns the
+ *                      compressed size, or 0 if it is not worth keeping.
+ *    zswap_store     - keep the last page compressed as the contents of
+ *                      SLOT. Fails if the pool has no room for it.
+ *    zswap_evict     - take the oldest page out of the pool to spill it.
+ *                      Returns its contents and puts its slot in *SLOT,
+ *                      or returns NULL if the pool is empty.
+ *    zswap_load      - if SLOT is in the pool, decompress it into PAGE,
+ *                      drop it from the pool, and return true.
+ *    zswap_contains  - whether SLOT is in the pool.
+ *    zswap_drop      - forget SLOT, if it is in the pool.
+ *
+ * The page codec can also be used by itself, e.g. to test it. These
+ * two need no lock and leave the pool alone.
+ *
+ *    zswap_encode    - compress PAGE into DST, of CAP bytes. Returns
+ *                      the compressed size, or 0 if it did not fit or
+ *                      there was no memory to do it.
+ *    zswap_decode    - decompress LEN bytes from SRC, as made by
+ *                      zswap_encode, into PAGE.
+ */
+#if OPT_ZSWAP
+void         zswap_bootstrap(void);
+size_t       zswap_compress(const void * page);
+bool         zswap_store(uint32_t slot);
+const void * zswap_evict(uint32_t * slot);
+bool         zswap_load(uint32_t slot, void * page);
+bool         zswap_contains(uint32_t slot);
+void         zswap_drop(uint32_t slot);
+size_t       zswap_encode(const void * page, void * dst, size_t cap);
+void         zswap_decode(const void * src, size_t len, void * page);
+#else
+#define zswap_bootstrap()           ((void)0)
+#define zswap_compress(page)        ((void)(page), (size_t)0)
+#define zswap_store(slot)           ((void)(slot), false)
+#define zswap_evict(slot)           ((void)(slot), (const void *)NULL)
+#define zswap_load(slot, page)      ((void)(slot), (void)(page), false)
+#define zswap_contains(slot)        ((void)(slot), false)
+#define zswap_drop(slot)            ((void)(slot))
+#endif
+
+#endif /* _ZSWAP_H_ */
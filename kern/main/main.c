@@ -47,6 +47,7 @@
 #include <vfs.h>
 #include <device.h>
 #include <syscall.h>
+#include <file.h>
 #include <test.h>
 #include <kern/test161.h>
 #include <version.h>
@@ -109,6 +110,8 @@ boot(void)
 	/* Early initialization. */
 	ram_bootstrap();
 	vm_bootstrap();
+	file_bootstrap();
+	fork_bootstrap();
 	proc_bootstrap();
 	thread_bootstrap();
 	hardclock_bootstrap();
@@ -18,6 +18,7 @@ cp ./thread/thread.c ../ops-class/os161/kern/thread/thread.c
 cp ./fs/file.c ../ops-class/os161/kern/fs/file.c
 cp ./proc/proc.c ../ops-class/os161/kern/proc/proc.c
 cp ./arch/mips/syscall/syscall.c ../ops-class/os161/kern/arch/mips/syscall/syscall.c
+cp ./syscall/loadelf.c ../ops-class/os161/kern/syscall/loadelf.c
 cp ./syscall/execv_syscalls.c ../ops-class/os161/kern/syscall/execv_syscalls.c
 cp ./syscall/exit_syscalls.c ../ops-class/os161/kern/syscall/exit_syscalls.c
 cp ./syscall/waitpid_syscalls.c ../ops-class/os161/kern/syscall/waitpid_syscalls.c
@@ -29,10 +30,28 @@ cp ./syscall/close_syscalls.c ../ops-class/os161/kern/syscall/close_syscalls.c
 cp ./syscall/read_syscalls.c ../ops-class/os161/kern/syscall/read_syscalls.c
 cp ./syscall/write_syscalls.c ../ops-class/os161/kern/syscall/write_syscalls.c
 cp ./syscall/lseek_syscalls.c ../ops-class/os161/kern/syscall/lseek_syscalls.c
+cp ./syscall/sbrk_syscalls.c ../ops-class/os161/kern/syscall/sbrk_syscalls.c
+cp ./syscall/mmap_syscalls.c ../ops-class/os161/kern/syscall/mmap_syscalls.c
+cp ./syscall/munmap_syscalls.c ../ops-class/os161/kern/syscall/munmap_syscalls.c
 
 cp ./arch/mips/arch/conf.arch ../ops-class/os161/kern/arch/mips/conf/conf.arch
 cp ./arch/mips/vm/tpvm.c      ../ops-class/os161/kern/arch/mips/vm/tpvm.c
+cp ./arch/mips/vm/swap.c      ../ops-class/os161/kern/arch/mips/vm/swap.c
+cp ./arch/mips/vm/zswap.c     ../ops-class/os161/kern/arch/mips/vm/zswap.c
+cp ./arch/mips/include/vm.h   ../ops-class/os161/kern/arch/mips/include/vm.h
 cp ./main/main.c ../ops-class/os161/kern/main/main.c
+cp ./main/menu.c ../ops-class/os161/kern/main/menu.c
 cp ./vm/addrspace.c ../ops-class/os161/kern/vm/addrspace.c
+cp ./vm/pagetable.c ../ops-class/os161/kern/vm/pagetable.c
+cp ./vm/pagecache.c ../ops-class/os161/kern/vm/pagecache.c
+cp ./vm/slab.c ../ops-class/os161/kern/vm/slab.c
+cp ./test/vmtest.c ../ops-class/os161/kern/test/vmtest.c
 cp ./include/addrspace.h ../ops-class/os161/kern/include/addrspace.h
-cp ./include/vm.h ../ops-class/os161/kern/include/vm.h
\ No newline at end of file
+cp ./include/pagetable.h ../ops-class/os161/kern/include/pagetable.h
+cp ./include/pagecache.h ../ops-class/os161/kern/include/pagecache.h
+cp ./include/slab.h ../ops-class/os161/kern/include/slab.h
+cp ./include/vm.h ../ops-class/os161/kern/include/vm.h
+cp ./include/swap.h ../ops-class/os161/kern/include/swap.h
+cp ./include/zswap.h ../ops-class/os161/kern/include/zswap.h
+cp ./include/vmtest.h ../ops-class/os161/kern/include/vmtest.h
+cp ./include/kern/mman.h ../ops-class/os161/kern/include/kern/mman.h
\ No newline at end of file
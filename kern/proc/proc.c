@@ -43,6 +43,7 @@
  */
 
 #include <types.h>
+#include <kern/errno.h>
 #include <spl.h>
 #include <proc.h>
 #include <current.h>
@@ -51,6 +52,7 @@
 #include <vfs.h>
 #include <kern/fcntl.h>
 #include <file.h>
+#include <slab.h>
 
 /*
  * The process for the kernel; this holds all the kernel-only threads.
@@ -59,6 +61,43 @@ struct proc *kproc;
 
 static pid_t cur_pid = 0;
 
+/*
+ * proc structures come from a slab cache. The locks they hold are made
+ * once by ProcCtor and kept while the structure is reused.
+ */
+DECLSLAB(proc);
+static struct procslab * proc_slab;
+
+static
+int
+ProcCtor(void * obj)
+{
+	struct proc * proc = obj;
+
+	spinlock_init(&proc->p_lock);
+	proc->p_locksubpwait = lock_create("proc");
+	if(proc->p_locksubpwait == NULL) {
+		return ENOMEM;
+	}
+	proc->p_cvsubpwait = cv_create("proc");
+	if(proc->p_cvsubpwait == NULL) {
+		lock_destroy(proc->p_locksubpwait);
+		return ENOMEM;
+	}
+	return 0;
+}
+
+static
+void
+ProcDtor(void * obj)
+{
+	struct proc * proc = obj;
+
+	cv_destroy(proc->p_cvsubpwait);
+	lock_destroy(proc->p_locksubpwait);
+	spinlock_cleanup(&proc->p_lock);
+}
+
 #define MAX_PID	65535
 pid_t Genarate_pid(void);
 
@@ -78,18 +117,17 @@ proc_create(const char *name)
 {
 	struct proc *proc;
 
-	proc = kmalloc(sizeof(*proc));
+	proc = procslab_alloc(proc_slab);
 	if (proc == NULL) {
 		return NULL;
 	}
 	proc->p_name = kstrdup(name);
 	if (proc->p_name == NULL) {
-		kfree(proc);
+		procslab_free(proc_slab, proc);
 		return NULL;
 	}
 
 	proc->p_numthreads = 0;
-	spinlock_init(&proc->p_lock);
 
 	/* VM fields */
 	proc->p_addrspace = NULL;
@@ -97,22 +135,6 @@ proc_create(const char *name)
 	/* VFS fields */
 	proc->p_cwd = NULL;
 
-	/* */
-	proc->p_locksubpwait = lock_create(name);
-	if(proc->p_locksubpwait == NULL) {
-		kfree(proc->p_name);
-		kfree(proc);
-		return NULL;
-	}
-
-	proc->p_cvsubpwait = cv_create(name);
-	if(proc->p_cvsubpwait == NULL) {
-		lock_destroy(proc->p_locksubpwait);
-		kfree(proc->p_name);
-		kfree(proc);
-		return NULL;
-	}
-
 	memset(proc->p_eventarray, 0, sizeof(*proc->p_eventarray) * 20);
 
 	/* Console support */
@@ -120,10 +142,8 @@ proc_create(const char *name)
 		struct file* fp;
 		proc->p_fds = files_struct_create(proc->p_name);
 		if(proc->p_fds == NULL) {
-			lock_destroy(proc->p_locksubpwait);
 			kfree(proc->p_name);
-			cv_destroy(proc->p_cvsubpwait);
-			kfree(proc);
+			procslab_free(proc_slab, proc);
 			return NULL;
 		}
 		fp = file_create((char*)"con:", O_RDWR, 0);
@@ -227,16 +247,12 @@ proc_destroy(struct proc *proc)
 	}
 
 	KASSERT(proc->p_numthreads == 0);
-	spinlock_cleanup(&proc->p_lock);
 
 	// release file-related fields
 	files_struct_destroy(proc->p_fds);
 
-	cv_destroy(proc->p_cvsubpwait);
-	lock_destroy(proc->p_locksubpwait);
-
 	kfree(proc->p_name);
-	kfree(proc);
+	procslab_free(proc_slab, proc);
 }
 
 /*
@@ -245,6 +261,10 @@ proc_destroy(struct proc *proc)
 void
 proc_bootstrap(void)
 {
+	proc_slab = procslab_create("proc", ProcCtor, ProcDtor);
+	if (proc_slab == NULL) {
+		panic("slab_create for proc failed\n");
+	}
 	kproc = proc_create("[kernel]");
 	if (kproc == NULL) {
 		panic("proc_create for kproc failed\n");
@@ -39,6 +39,28 @@
 #include <addrspace.h>
 #include <vm.h>
 #include <mips/trapframe.h>
+#include <slab.h>
+
+/*
+ * What the parent hands the child thread, from a slab cache since
+ * every fork needs one.
+ */
+struct forkargs {
+    struct trapframe tf;
+    struct addrspace * as;
+};
+
+DECLSLAB(forkargs);
+static struct forkargsslab * forkargs_slab;
+
+void
+fork_bootstrap(void)
+{
+    forkargs_slab = forkargsslab_create("forkargs", NULL, NULL);
+    if(forkargs_slab == NULL) {
+        panic("slab_create for forkargs failed\n");
+    }
+}
 
 static
 void
@@ -47,14 +69,11 @@ forkthread(void *ptr, unsigned long nargs)
     (void)nargs;
 
     struct trapframe tf;
-    struct addrspace * as;
-    void * tfp = ((void**)ptr)[0];
-    as = (struct addrspace*)(((void**)ptr)[1]);
-    memcpy(&tf, tfp, sizeof(tf));
-    proc_setas(as);
+    struct forkargs * args = ptr;
+    memcpy(&tf, &args->tf, sizeof(tf));
+    proc_setas(args->as);
     as_activate();
-    kfree(tfp);
-    kfree(ptr);
+    forkargsslab_free(forkargs_slab, args);
 
     enter_forked_process(&tf);
 }
@@ -69,7 +88,7 @@ sys_fork(struct trapframe * tf)
     // create new proc, copy addrspace
     // copy fds
     // set up stack
-    void** args = kmalloc(2 * sizeof(void*));
+    struct forkargs * args = forkargsslab_alloc(forkargs_slab);
     if(args == NULL) {
         return -1;
     }
@@ -81,11 +100,13 @@ sys_fork(struct trapframe * tf)
 
     result = as_copy(curthread->t_proc->p_addrspace, &as);
     if(result) {
+        forkargsslab_free(forkargs_slab, args);
         return -1;
     }
 
     proc = proc_create_runprogram(curthread->t_proc->p_name);
     if(proc == NULL) {
+        forkargsslab_free(forkargs_slab, args);
         as_destroy(as);
         return -1;
     }
@@ -95,16 +116,15 @@ sys_fork(struct trapframe * tf)
     files_struct_incref(curproc->p_fds);
     proc->p_fds = curproc->p_fds;
 
-    struct trapframe * tfp = kmalloc(sizeof(struct trapframe));
-    memcpy(tfp, tf, sizeof(struct trapframe));
-    args[0] = tfp;
-    args[1] = as;
+    memcpy(&args->tf, tf, sizeof(struct trapframe));
+    args->as = as;
 
     result = thread_fork("forked_thread",
             proc,
             forkthread,
             args, 2);
     if (result) {
+        forkargsslab_free(forkargs_slab, args);
         as_destroy(as);
         proc_destroy(proc);
         return -1;
@@ -0,0 +1,236 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * Code to load an ELF-format executable into the current address space.
+ *
+ * It makes the following address space calls:
+ *    - first, as_define_region once for each segment of the program;
+ *    - then, as_prepare_load;
+ *    - then it attaches the file contents of each chunk of the program
+ *      with as_define_file;
+ *    - finally, as_complete_load.
+ *
+ * Nothing is read from the file here apart from the headers. The
+ * address space keeps a reference to the vnode and reads each page
+ * from it the first time the page is touched.
+ *
+ * To support dynamically linked executables with shared libraries
+ * you'd need to change this to load the "ELF interpreter" (dynamic
+ * linker). And you'd have to write a dynamic linker...
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <uio.h>
+#include <proc.h>
+#include <current.h>
+#include <addrspace.h>
+#include <vnode.h>
+#include <elf.h>
+
+/*
+ * Read program header I of the executable into PH.
+ */
+static
+int
+load_phdr(struct vnode *v, const Elf_Ehdr *eh, int i, Elf_Phdr *ph)
+{
+	struct iovec iov;
+	struct uio ku;
+	int result;
+
+	off_t offset = eh->e_phoff + i*eh->e_phentsize;
+	uio_kinit(&iov, &ku, ph, sizeof(*ph), offset, UIO_READ);
+
+	result = VOP_READ(v, &ku);
+	if (result) {
+		return result;
+	}
+
+	if (ku.uio_resid != 0) {
+		/* short read; problem with executable? */
+		kprintf("ELF: short read on phdr - file truncated?\n");
+		return ENOEXEC;
+	}
+
+	return 0;
+}
+
+/*
+ * Load an ELF executable user program into the current address space.
+ *
+ * Returns the entry point (initial PC) for the program in ENTRYPOINT.
+ */
+int
+load_elf(struct vnode *v, vaddr_t *entrypoint)
+{
+	Elf_Ehdr eh;   /* Executable header */
+	Elf_Phdr ph;   /* "Program header" = segment header */
+	int result, i;
+	struct iovec iov;
+	struct uio ku;
+	struct addrspace *as;
+
+	as = proc_getas();
+
+	/*
+	 * Read the executable header from offset 0 in the file.
+	 */
+
+	uio_kinit(&iov, &ku, &eh, sizeof(eh), 0, UIO_READ);
+	result = VOP_READ(v, &ku);
+	if (result) {
+		return result;
+	}
+
+	if (ku.uio_resid != 0) {
+		/* short read; problem with executable? */
+		kprintf("ELF: short read on header - file truncated?\n");
+		return ENOEXEC;
+	}
+
+	/*
+	 * Check to make sure it's a 32-bit ELF-version-1 executable
+	 * for our processor type. If it's not, we can't run it.
+	 *
+	 * Ignore EI_OSABI and EI_ABIVERSION - properly, we should
+	 * define our own, but that would require tinkering with the
+	 * linker to have it emit our magic numbers instead of the
+	 * default ones. (If the linker even supports these fields,
+	 * which were not in the original elf spec.)
+	 */
+
+	if (eh.e_ident[EI_MAG0] != ELFMAG0 ||
+	    eh.e_ident[EI_MAG1] != ELFMAG1 ||
+	    eh.e_ident[EI_MAG2] != ELFMAG2 ||
+	    eh.e_ident[EI_MAG3] != ELFMAG3 ||
+	    eh.e_ident[EI_CLASS] != ELFCLASS32 ||
+	    eh.e_ident[EI_DATA] != ELFDATA2MSB ||
+	    eh.e_ident[EI_VERSION] != EV_CURRENT ||
+	    eh.e_version != EV_CURRENT ||
+	    eh.e_type!=ET_EXEC ||
+	    eh.e_machine!=EM_MACHINE) {
+		return ENOEXEC;
+	}
+
+	/*
+	 * Go through the list of segments and set up the address space.
+	 *
+	 * Ordinarily there will be one code segment, one read-only
+	 * data segment, and one data/bss segment, but there might
+	 * conceivably be more. You don't need to support such files
+	 * if it's unduly awkward to do so.
+	 *
+	 * Note that the expression eh.e_phoff + i*eh.e_phentsize is
+	 * mandated by the ELF standard - we use sizeof(ph) to load,
+	 * because that's the structure we know, but the file on disk
+	 * might have a larger structure, so we must use e_phentsize
+	 * to find where the phdr starts.
+	 */
+
+	for (i=0; i<eh.e_phnum; i++) {
+		result = load_phdr(v, &eh, i, &ph);
+		if (result) {
+			return result;
+		}
+
+		switch (ph.p_type) {
+		    case PT_NULL: /* skip */ continue;
+		    case PT_PHDR: /* skip */ continue;
+		    case PT_MIPS_REGINFO: /* skip */ continue;
+		    case PT_LOAD: break;
+		    default:
+			kprintf("loadelf: unknown segment type %d\n",
+				ph.p_type);
+			return ENOEXEC;
+		}
+
+		result = as_define_region(as,
+					  ph.p_vaddr, ph.p_memsz,
+					  ph.p_flags & PF_R,
+					  ph.p_flags & PF_W,
+					  ph.p_flags & PF_X);
+		if (result) {
+			return result;
+		}
+	}
+
+	result = as_prepare_load(as);
+	if (result) {
+		return result;
+	}
+
+	/*
+	 * Now attach the file contents of each segment. The part of
+	 * the segment past FILESIZE is left to be zero-filled.
+	 */
+
+	for (i=0; i<eh.e_phnum; i++) {
+		result = load_phdr(v, &eh, i, &ph);
+		if (result) {
+			return result;
+		}
+
+		switch (ph.p_type) {
+		    case PT_NULL: /* skip */ continue;
+		    case PT_PHDR: /* skip */ continue;
+		    case PT_MIPS_REGINFO: /* skip */ continue;
+		    case PT_LOAD: break;
+		    default:
+			kprintf("loadelf: unknown segment type %d\n",
+				ph.p_type);
+			return ENOEXEC;
+		}
+
+		if (ph.p_filesz > ph.p_memsz) {
+			kprintf("ELF: warning: segment filesize > segment memsize\n");
+			ph.p_filesz = ph.p_memsz;
+		}
+
+		DEBUG(DB_EXEC, "ELF: Mapping %lu bytes at 0x%lx\n",
+		      (unsigned long) ph.p_filesz, (unsigned long) ph.p_vaddr);
+
+		result = as_define_file(as, ph.p_vaddr, v,
+					ph.p_offset, ph.p_filesz);
+		if (result) {
+			return result;
+		}
+	}
+
+	result = as_complete_load(as);
+	if (result) {
+		return result;
+	}
+
+	*entrypoint = eh.e_entry;
+
+	return 0;
+}
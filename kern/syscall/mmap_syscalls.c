@@ -0,0 +1,103 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+#include <types.h>
+#include <syscall.h>
+#include <lib.h>
+#include <file.h>
+#include <proc.h>
+#include <current.h>
+#include <addrspace.h>
+#include <vnode.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <kern/mman.h>
+#include <kern/stat.h>
+
+/*
+ * mmap system call:
+ */
+void *
+sys_mmap(void * addr, size_t len, int prot, int flags, int fd, off_t offset)
+{
+    struct addrspace * as = proc_getas();
+    if(as == NULL) {
+        return (void *)-EFAULT;
+    }
+
+    int type = flags & (MAP_SHARED | MAP_PRIVATE);
+    if(type != MAP_SHARED && type != MAP_PRIVATE) {
+        return (void *)-EINVAL;
+    }
+    if(offset < 0 || (offset & ~(off_t)PAGE_FRAME) != 0) {
+        return (void *)-EINVAL;
+    }
+
+    struct file * fp = NULL;
+    struct vnode * vn = NULL;
+    size_t filesize = 0;
+    bool writeback = false;
+    int err = 0;
+    if((flags & MAP_ANON) == 0) {
+        fp = files_struct_get(curproc->p_fds, fd);
+        if(fp == NULL) {
+            return (void *)-EBADF;
+        }
+        // Keep the file open until the mapping holds its own
+        // reference to the vnode.
+        file_addref(fp, false);
+        int accmode = fp->flags & O_ACCMODE;
+        writeback = type == MAP_SHARED && (prot & PROT_WRITE) != 0;
+        if(accmode == O_WRONLY || (writeback && accmode != O_RDWR)) {
+            err = EACCES;
+        }
+
+        struct stat st;
+        if(!err) {
+            err = VOP_STAT(fp->inode, &st);
+        }
+        if(!err && st.st_size > offset) {
+            filesize = (size_t)MIN(st.st_size - offset, (off_t)len);
+        }
+        vn = fp->inode;
+    }
+
+    vaddr_t ret;
+    if(!err) {
+        err = as_mmap(as, (vaddr_t)addr, len, prot, vn, offset, filesize,
+                writeback, &ret);
+    }
+    if(fp != NULL) {
+        file_destroy(fp);
+    }
+    if(err) {
+        return (void *)-err;
+    }
+    return (void *)ret;
+}
@@ -0,0 +1,419 @@
+/*
+ * Tests of the VM system: the buddy page allocator, the slab allocator
+ * and the zswap page codec.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <vm.h>
+#include <slab.h>
+#include <zswap.h>
+#include <vmtest.h>
+#include <kern/test161.h>
+
+/*
+ * Sizes asked of alloc_kpages, each twice; 3 rounds up to a block of
+ * 4. KPAGES_MAX is asked for once on its own, as there may well not be
+ * two such blocks free.
+ */
+static const unsigned bt_sizes[] = { 1, 2, 3, 8, 1, 2, 3, 8 };
+#define BT_NSIZES	(sizeof(bt_sizes) / sizeof(bt_sizes[0]))
+
+static
+unsigned
+BtBlock(unsigned npages)
+{
+	unsigned block = 1;
+	while(block < npages) {
+		block <<= 1;
+	}
+	return block;
+}
+
+static
+bool
+BtCheck(vaddr_t addr, unsigned npages, uint8_t tag)
+{
+	const uint8_t * p = (const uint8_t *)addr;
+	for(size_t i = 0; i < npages * PAGE_SIZE; i++) {
+		if(p[i] != tag) {
+			return false;
+		}
+	}
+	return true;
+}
+
+int
+buddytest(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	bool status = TEST161_FAIL;
+	vaddr_t addrs[BT_NSIZES];
+	vaddr_t big = 0;
+	unsigned i, j, base, want = 0;
+
+	kprintf_n("buddy allocator test...\n");
+	// Nothing below may kmalloc, or the count will not come back.
+	base = coremap_used_bytes();
+	for(i = 0; i < BT_NSIZES; i++) {
+		addrs[i] = 0;
+	}
+
+	for(i = 0; i < BT_NSIZES; i++) {
+		addrs[i] = alloc_kpages(bt_sizes[i]);
+		if(addrs[i] == 0) {
+			kprintf_n("buddytest: no block of %u pages\n", bt_sizes[i]);
+			goto done;
+		}
+		memset((void *)addrs[i], 0x10 + i, bt_sizes[i] * PAGE_SIZE);
+		want += BtBlock(bt_sizes[i]) * PAGE_SIZE;
+	}
+	if(coremap_used_bytes() != base + want) {
+		kprintf_n("buddytest: %u bytes in use, expected %u\n",
+			  coremap_used_bytes(), base + want);
+		goto done;
+	}
+
+	// Blocks start on a multiple of their size from the start of
+	// memory, so two of the same size are a multiple of it apart.
+	for(i = 0; i < BT_NSIZES / 2; i++) {
+		vaddr_t a = addrs[i], b = addrs[i + BT_NSIZES / 2];
+		vaddr_t dist = a > b ? a - b : b - a;
+		if(dist % (BtBlock(bt_sizes[i]) * PAGE_SIZE) != 0) {
+			kprintf_n("buddytest: %u-page blocks at 0x%x and 0x%x "
+				  "are misaligned\n", bt_sizes[i], a, b);
+			goto done;
+		}
+	}
+
+	// Writing each block clobbered no other.
+	for(i = 0; i < BT_NSIZES; i++) {
+		if(!BtCheck(addrs[i], bt_sizes[i], 0x10 + i)) {
+			kprintf_n("buddytest: block at 0x%x was overwritten\n",
+				  addrs[i]);
+			goto done;
+		}
+	}
+
+	// Free in an order that makes buddies merge late.
+	for(j = 0; j < 2; j++) {
+		for(i = j; i < BT_NSIZES; i += 2) {
+			free_kpages(addrs[i]);
+			addrs[i] = 0;
+		}
+	}
+	if(coremap_used_bytes() != base) {
+		kprintf_n("buddytest: %u bytes in use after freeing, was %u\n",
+			  coremap_used_bytes(), base);
+		goto done;
+	}
+
+	// Last, as finding room for it may reclaim or swap, which moves
+	// the count above.
+	big = alloc_kpages(KPAGES_MAX);
+	if(big == 0) {
+		kprintf_n("  no free block of %u pages, not tried\n", KPAGES_MAX);
+	} else {
+		memset((void *)big, 0x5a, KPAGES_MAX * PAGE_SIZE);
+		if(!BtCheck(big, KPAGES_MAX, 0x5a)) {
+			kprintf_n("buddytest: %u-page block does not hold "
+				  "its contents\n", KPAGES_MAX);
+			goto done;
+		}
+		free_kpages(big);
+		big = 0;
+	}
+	if(alloc_kpages(KPAGES_MAX + 1) != 0) {
+		kprintf_n("buddytest: got more than KPAGES_MAX pages\n");
+		goto done;
+	}
+
+	status = TEST161_SUCCESS;
+
+done:
+	for(i = 0; i < BT_NSIZES; i++) {
+		if(addrs[i] != 0) {
+			free_kpages(addrs[i]);
+		}
+	}
+	if(big != 0) {
+		free_kpages(big);
+	}
+	success(status, SECRET, "bdt1");
+	return 0;
+}
+
+/*
+ * An object of an awkward size, so it is rounded up to SLAB_ALIGN. The
+ * constructor stamps MAGIC, which the test never writes, so an object
+ * that comes out of the cache without it was never constructed, or was
+ * destroyed while still in use.
+ */
+struct slabtest {
+	uint32_t magic;
+	uint32_t tag;
+	char fill[92];
+};
+DECLSLAB(slabtest);
+
+#define ST_MAGIC	0x51ab7e57
+#define ST_NOBJS	128		/* several slabs' worth */
+
+static struct slabtestslab * st_cache;
+static unsigned st_ctors, st_dtors, st_baddtors;
+static struct slabtest * st_objs[ST_NOBJS];
+
+static
+int
+StCtor(void * p)
+{
+	struct slabtest * obj = p;
+	obj->magic = ST_MAGIC;
+	st_ctors++;
+	return 0;
+}
+
+static
+void
+StDtor(void * p)
+{
+	struct slabtest * obj = p;
+	if(obj->magic != ST_MAGIC) {
+		st_baddtors++;
+	}
+	obj->magic = 0;
+	st_dtors++;
+}
+
+/*
+ * Fill all of ST_OBJS, tagging each object with its index, and check
+ * what comes back.
+ */
+static
+bool
+StFill(void)
+{
+	unsigned i, j;
+
+	for(i = 0; i < ST_NOBJS; i++) {
+		struct slabtest * obj = slabtestslab_alloc(st_cache);
+		if(obj == NULL) {
+			kprintf_n("slabtest: out of memory at object %u\n", i);
+			return false;
+		}
+		st_objs[i] = obj;
+		if((vaddr_t)obj % SLAB_ALIGN != 0) {
+			kprintf_n("slabtest: object at %p is misaligned\n", obj);
+			return false;
+		}
+		if(obj->magic != ST_MAGIC) {
+			kprintf_n("slabtest: object at %p is not constructed\n",
+				  obj);
+			return false;
+		}
+		obj->tag = i;
+		memset(obj->fill, i & 0xff, sizeof(obj->fill));
+	}
+
+	// Writing each object clobbered no other.
+	for(i = 0; i < ST_NOBJS; i++) {
+		struct slabtest * obj = st_objs[i];
+		bool ok = obj->magic == ST_MAGIC && obj->tag == i;
+		for(j = 0; ok && j < sizeof(obj->fill); j++) {
+			ok = (uint8_t)obj->fill[j] == (i & 0xff);
+		}
+		if(!ok) {
+			kprintf_n("slabtest: object at %p was overwritten\n", obj);
+			return false;
+		}
+	}
+	return true;
+}
+
+static
+void
+StEmpty(void)
+{
+	unsigned i;
+
+	for(i = 0; i < ST_NOBJS; i++) {
+		if(st_objs[i] != NULL) {
+			slabtestslab_free(st_cache, st_objs[i]);
+			st_objs[i] = NULL;
+		}
+	}
+}
+
+int
+slabtest(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	bool status = TEST161_FAIL;
+	unsigned ctors, dtors;
+	struct slabtest * obj;
+
+	kprintf_n("slab allocator test...\n");
+	// There is no slab_destroy, so one cache serves every run.
+	if(st_cache == NULL) {
+		st_cache = slabtestslab_create("slabtest", StCtor, StDtor);
+		if(st_cache == NULL) {
+			kprintf_n("slabtest: could not create the cache\n");
+			goto done;
+		}
+	}
+
+	if(!StFill()) {
+		goto done;
+	}
+	if(st_ctors < ST_NOBJS) {
+		kprintf_n("slabtest: %u objects live, %u constructed\n",
+			  ST_NOBJS, st_ctors);
+		goto done;
+	}
+
+	// A freed object goes to this CPU's magazine and is the next one
+	// handed out, as it was left and without constructing another.
+	obj = st_objs[0];
+	ctors = st_ctors;
+	slabtestslab_free(st_cache, obj);
+	st_objs[0] = slabtestslab_alloc(st_cache);
+	if(st_objs[0] != obj || obj->magic != ST_MAGIC || obj->tag != 0 ||
+	   st_ctors != ctors) {
+		kprintf_n("slabtest: freed object at %p did not come back "
+			  "as it was\n", obj);
+		goto done;
+	}
+
+	// Emptying gives whole slabs back, bar the spare and those the
+	// few objects left in magazines keep; filling again takes new ones.
+	dtors = st_dtors;
+	StEmpty();
+	if(st_dtors == dtors) {
+		kprintf_n("slabtest: no slab given back after freeing %u "
+			  "objects\n", ST_NOBJS);
+		goto done;
+	}
+	if(!StFill()) {
+		goto done;
+	}
+	StEmpty();
+	if(st_baddtors != 0) {
+		kprintf_n("slabtest: %u objects destroyed unconstructed\n",
+			  st_baddtors);
+		goto done;
+	}
+	kprintf_n("  %u constructed, %u destroyed so far\n", st_ctors,
+		  st_dtors);
+	status = TEST161_SUCCESS;
+
+done:
+	StEmpty();
+	success(status, SECRET, "slt1");
+	return 0;
+}
+
+#if OPT_ZSWAP
+
+/* Room for a page that does not compress at all, plus token overhead. */
+#define ZT_CAP	(PAGE_SIZE + PAGE_SIZE / 255 + 16)
+
+/*
+ * Fills PAGE according to KIND: zeros, a short repeating pattern,
+ * words with the odd gap, noise, or noise with a repeated tail. Between
+ * them they hit empty and long matches, long literal runs and the
+ * match that runs into the end of the page.
+ */
+static
+void
+ZtFill(uint8_t * page, unsigned kind)
+{
+	static const char words[] = "the quick brown fox jumps over ";
+	uint32_t seed = 0x2545f491 + kind;
+	unsigned i;
+
+	for(i = 0; i < PAGE_SIZE; i++) {
+		seed = seed * 1103515245 + 12345;
+		switch(kind) {
+		case 0:
+			page[i] = 0;
+			break;
+		case 1:
+			page[i] = (uint8_t)(i % 7);
+			break;
+		case 2:
+			page[i] = (seed >> 24) < 8 ? '\n' : words[i % (sizeof(words) - 1)];
+			break;
+		case 3:
+			page[i] = (uint8_t)(seed >> 16);
+			break;
+		default:
+			page[i] = i < PAGE_SIZE / 2 ? (uint8_t)(seed >> 16) : 0x5a;
+			break;
+		}
+	}
+}
+
+#define ZT_KINDS	5
+
+int
+zswaptest(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	bool status = TEST161_FAIL;
+	uint8_t *page, *out, *back;
+	unsigned kind;
+
+	kprintf_n("zswap codec test...\n");
+	page = kmalloc(PAGE_SIZE);
+	out = kmalloc(ZT_CAP);
+	back = kmalloc(PAGE_SIZE);
+	if(page == NULL || out == NULL || back == NULL) {
+		kprintf_n("zswaptest: out of memory\n");
+		goto done;
+	}
+
+	for(kind = 0; kind < ZT_KINDS; kind++) {
+		ZtFill(page, kind);
+		size_t len = zswap_encode(page, out, ZT_CAP);
+		if(len == 0) {
+			kprintf_n("zswaptest: pattern %u did not encode\n", kind);
+			goto done;
+		}
+		memset(back, 0xa5, PAGE_SIZE);
+		zswap_decode(out, len, back);
+		if(memcmp(page, back, PAGE_SIZE) != 0) {
+			kprintf_n("zswaptest: pattern %u did not survive\n", kind);
+			goto done;
+		}
+		kprintf_n("  pattern %u: %u -> %u bytes\n", kind,
+			  (unsigned)PAGE_SIZE, (unsigned)len);
+
+		// Too small a buffer must be refused, not overrun.
+		if(len > 1) {
+			out[len - 1] ^= 0xff;
+			uint8_t guard = out[len - 1];
+			if(zswap_encode(page, out, len - 1) != 0 ||
+			   out[len - 1] != guard) {
+				kprintf_n("zswaptest: pattern %u overran %u bytes\n",
+					  kind, (unsigned)(len - 1));
+				goto done;
+			}
+		}
+	}
+	status = TEST161_SUCCESS;
+
+done:
+	kfree(back);
+	kfree(out);
+	kfree(page);
+	success(status, SECRET, "zt1");
+	return 0;
+}
+
+#endif /* OPT_ZSWAP */
@@ -231,6 +231,27 @@ lock_release(struct lock *lock)
 	(void)lock;  // suppress warning until code gets written
 }
 
+bool
+lock_tryacquire(struct lock *lock)
+{
+	bool got = false;
+	spinlock_acquire(&lock->lk_lock);
+	if(lock->lk_thread == NULL)
+	{
+		lock->lk_thread = curthread;
+		got = true;
+	}
+	spinlock_release(&lock->lk_lock);
+
+	if(got)
+	{
+		/* Never waited, but hangman wants to see both. */
+		HANGMAN_WAIT(&curthread->t_hangman, &lock->lk_hangman);
+		HANGMAN_ACQUIRE(&curthread->t_hangman, &lock->lk_hangman);
+	}
+	return got;
+}
+
 bool
 lock_do_i_hold(struct lock *lock)
 {
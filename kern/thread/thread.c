@@ -1171,29 +1171,89 @@ ipi_tlbshootdown(struct cpu *target, const struct tlbshootdown *mapping)
 	spinlock_acquire(&target->c_ipi_lock);
 
 	n = target->c_numshootdown;
-	if (n == TLBSHOOTDOWN_MAX) {
+	if (n > 0 && TLBSHOOTDOWN_ALL(&target->c_shootdown[0])) {
+		/* Already flushing everything. */
+	}
+	else if (n == TLBSHOOTDOWN_MAX || TLBSHOOTDOWN_ALL(mapping)) {
 		/*
-		 * If you have problems with this panic going off,
-		 * consider: (1) increasing the maximum, (2) putting
-		 * logic here to sleep until space appears (may
-		 * interact awkwardly with VM system locking), (3)
-		 * putting logic here to coalesce requests together,
-		 * and/or (4) improving VM system state tracking to
-		 * reduce the number of unnecessary shootdowns.
+		 * No room, or asked for a full flush anyway: that covers
+		 * whatever is queued and this one too.
 		 */
-		panic("ipi_tlbshootdown: Too many shootdowns queued\n");
+		target->c_shootdown[0].ts_vaddr = 0;
+		target->c_shootdown[0].ts_asid = 0;
+		target->c_shootdown[0].ts_gen = 0;
+		target->c_numshootdown = 1;
 	}
 	else {
-		target->c_shootdown[n] = *mapping;
-		target->c_numshootdown = n+1;
+		unsigned i;
+
+		/* Drop duplicates of a mapping that is already queued. */
+		for (i=0; i<n; i++) {
+			if (target->c_shootdown[i].ts_vaddr == mapping->ts_vaddr &&
+			    target->c_shootdown[i].ts_asid == mapping->ts_asid &&
+			    target->c_shootdown[i].ts_gen == mapping->ts_gen) {
+				break;
+			}
+		}
+		if (i == n) {
+			target->c_shootdown[n] = *mapping;
+			target->c_numshootdown = n+1;
+		}
 	}
 
-	target->c_ipi_pending |= (uint32_t)1 << IPI_TLBSHOOTDOWN;
-	mainbus_send_ipi(target);
+	/*
+	 * One interrupt handles the whole queue, so only send one if
+	 * none is outstanding.
+	 */
+	if ((target->c_ipi_pending & ((uint32_t)1 << IPI_TLBSHOOTDOWN)) == 0) {
+		target->c_ipi_pending |= (uint32_t)1 << IPI_TLBSHOOTDOWN;
+		mainbus_send_ipi(target);
+	}
 
 	spinlock_release(&target->c_ipi_lock);
 }
 
+/*
+ * Send the N TLB shootdowns at MAPPINGS to every CPU whose number is
+ * set in MASK, then wait until each has handled its queue. Everything
+ * for one CPU is queued before its interrupt is taken, so it gets one
+ * IPI. This spins, so call it with interrupts on and no spinlocks held.
+ */
+void
+ipi_tlbshootdown_mask(uint32_t mask, const struct tlbshootdown *mappings,
+		      unsigned n)
+{
+	struct cpu *c;
+	unsigned i, j, numcpus;
+	bool pending;
+
+	numcpus = cpuarray_num(&allcpus);
+	for (i=0; i < numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c->c_number >= 32 ||
+		    (mask & ((uint32_t)1 << c->c_number)) == 0) {
+			continue;
+		}
+		for (j=0; j<n; j++) {
+			ipi_tlbshootdown(c, &mappings[j]);
+		}
+	}
+
+	for (i=0; i < numcpus; i++) {
+		c = cpuarray_get(&allcpus, i);
+		if (c->c_number >= 32 ||
+		    (mask & ((uint32_t)1 << c->c_number)) == 0) {
+			continue;
+		}
+		do {
+			spinlock_acquire(&c->c_ipi_lock);
+			pending = (c->c_ipi_pending &
+				   ((uint32_t)1 << IPI_TLBSHOOTDOWN)) != 0;
+			spinlock_release(&c->c_ipi_lock);
+		} while (pending);
+	}
+}
+
 /*
  * Handle an incoming interprocessor interrupt.
  */
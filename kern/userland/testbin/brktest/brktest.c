@@ -0,0 +1,160 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * brktest - exercise sbrk.
+ *
+ * Grows the heap and checks that the new pages read as zero and hold
+ * what is written to them, shrinks it and checks that the pages given
+ * back come back zeroed rather than with their old contents, and
+ * checks that bad amounts fail without moving the break.
+ */
+
+#include <sys/types.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <err.h>
+
+#define PAGE 4096
+#define NPAGES 8
+
+/* Most and least an intptr_t can say, for the error cases */
+#define AMOUNT_MAX ((intptr_t)(~(uintptr_t)0 >> 1))
+#define AMOUNT_MIN (-AMOUNT_MAX - 1)
+
+static
+char *
+xsbrk(intptr_t amount)
+{
+	void *p = sbrk(amount);
+	if (p == (void *)-1) {
+		err(1, "sbrk(%ld)", (long)amount);
+	}
+	return p;
+}
+
+static
+void
+checkbreak(char *expect)
+{
+	char *now = xsbrk(0);
+	if (now != expect) {
+		errx(1, "break is %p, expected %p", now, expect);
+	}
+}
+
+static
+void
+checkfill(char *p, size_t len, int val, const char *what)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if (p[i] != (char)val) {
+			errx(1, "%s: byte %lu is %d, expected %d", what,
+			     (unsigned long)i, p[i], val);
+		}
+	}
+}
+
+static
+void
+checkbad(intptr_t amount, int expecterr)
+{
+	char *before = xsbrk(0);
+
+	errno = 0;
+	if (sbrk(amount) != (void *)-1) {
+		errx(1, "sbrk(%ld) succeeded", (long)amount);
+	}
+	if (errno != expecterr) {
+		errx(1, "sbrk(%ld): errno %d, expected %d", (long)amount,
+		     errno, expecterr);
+	}
+	checkbreak(before);
+}
+
+int
+main(void)
+{
+	char *base, *p;
+	int i;
+
+	base = xsbrk(0);
+	printf("brktest: break starts at %p\n", base);
+
+	/* Grow: new memory is zeroed and keeps what is written. */
+	p = xsbrk(NPAGES * PAGE);
+	if (p != base) {
+		errx(1, "sbrk returned %p, expected %p", p, base);
+	}
+	checkbreak(base + NPAGES * PAGE);
+	checkfill(base, NPAGES * PAGE, 0, "new heap");
+	for (i = 0; i < NPAGES; i++) {
+		memset(base + i * PAGE, 'a' + i, PAGE);
+	}
+	for (i = 0; i < NPAGES; i++) {
+		checkfill(base + i * PAGE, PAGE, 'a' + i, "written heap");
+	}
+
+	/* Amounts that are not whole pages move the break exactly. */
+	p = xsbrk(100);
+	checkbreak(p + 100);
+	xsbrk(-100);
+	checkbreak(base + NPAGES * PAGE);
+
+	/* Shrink: the top pages go away, the rest are untouched. */
+	xsbrk(-(NPAGES / 2) * PAGE);
+	checkbreak(base + (NPAGES / 2) * PAGE);
+	for (i = 0; i < NPAGES / 2; i++) {
+		checkfill(base + i * PAGE, PAGE, 'a' + i, "kept heap");
+	}
+
+	/* Growing again gives back zeroed pages, not the old contents. */
+	xsbrk((NPAGES / 2) * PAGE);
+	checkfill(base + (NPAGES / 2) * PAGE, (NPAGES / 2) * PAGE, 0,
+		  "regrown heap");
+
+	/*
+	 * Shrinking past the start of the heap, or growing into the
+	 * stack, fails and leaves the break alone.
+	 */
+	checkbad(-(intptr_t)(uintptr_t)xsbrk(0) - PAGE, EINVAL);
+	checkbad(AMOUNT_MIN, EINVAL);
+	checkbad(AMOUNT_MAX, ENOMEM);
+
+	xsbrk(-NPAGES * PAGE);
+	checkbreak(base);
+
+	printf("brktest: passed\n");
+	return 0;
+}
@@ -0,0 +1,259 @@
+/*
+ * Copyright (c) 2000, 2001, 2002, 2003, 2004, 2005, 2008, 2009
+ *	The President and Fellows of Harvard College.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. Neither the name of the University nor the names of its contributors
+ *    may be used to endorse or promote products derived from this software
+ *    without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE UNIVERSITY AND CONTRIBUTORS ``AS IS'' AND
+ * ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED.  IN NO EVENT SHALL THE UNIVERSITY OR CONTRIBUTORS BE LIABLE
+ * FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL
+ * DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS
+ * OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS INTERRUPTION)
+ * HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+ * LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY
+ * OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF
+ * SUCH DAMAGE.
+ */
+
+/*
+ * mmaptest - exercise mmap and munmap.
+ *
+ * Maps anonymous memory and checks it is zeroed and private, punches
+ * a hole in the middle of a mapping and unmaps the rest around it,
+ * maps a file shared and checks that what is written through the
+ * mapping reaches the file on munmap, maps it private and checks that
+ * nothing does, and checks that bad arguments are refused.
+ */
+
+#include <sys/types.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <err.h>
+#include <kern/mman.h>
+
+/* libc has no prototypes for these; the syscall stubs exist. */
+void *mmap(void *addr, size_t len, int prot, int flags, int fd, off_t offset);
+int munmap(void *addr, size_t len);
+
+#define PAGE 4096
+#define NPAGES 4
+#define FILENAME "mmaptest.dat"
+
+static
+void
+checkfill(const char *p, size_t len, int val, const char *what)
+{
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if (p[i] != (char)val) {
+			errx(1, "%s: byte %lu is %d, expected %d", what,
+			     (unsigned long)i, p[i], val);
+		}
+	}
+}
+
+static
+char *
+xmmap(size_t len, int flags, int fd)
+{
+	void *p = mmap(NULL, len, PROT_READ | PROT_WRITE, flags, fd, 0);
+	if (p == MAP_FAILED) {
+		err(1, "mmap");
+	}
+	return p;
+}
+
+static
+void
+xmunmap(void *p, size_t len)
+{
+	if (munmap(p, len) < 0) {
+		err(1, "munmap(%p, %lu)", p, (unsigned long)len);
+	}
+}
+
+static
+void
+checkbadmap(size_t len, int prot, int flags, int fd, off_t offset,
+	    int expecterr, const char *what)
+{
+	errno = 0;
+	if (mmap(NULL, len, prot, flags, fd, offset) != MAP_FAILED) {
+		errx(1, "mmap with %s succeeded", what);
+	}
+	if (errno != expecterr) {
+		errx(1, "mmap with %s: errno %d, expected %d", what, errno,
+		     expecterr);
+	}
+}
+
+static
+void
+checkbadunmap(void *p, size_t len, const char *what)
+{
+	errno = 0;
+	if (munmap(p, len) == 0) {
+		errx(1, "munmap of %s succeeded", what);
+	}
+	if (errno != EINVAL) {
+		errx(1, "munmap of %s: errno %d, expected EINVAL", what, errno);
+	}
+}
+
+static
+void
+anontest(void)
+{
+	char *p;
+	int i;
+
+	p = xmmap(NPAGES * PAGE, MAP_PRIVATE | MAP_ANON, -1);
+	checkfill(p, NPAGES * PAGE, 0, "anonymous map");
+	for (i = 0; i < NPAGES; i++) {
+		memset(p + i * PAGE, 'a' + i, PAGE);
+	}
+
+	/* Punch a hole; both sides keep their contents. */
+	xmunmap(p + PAGE, PAGE);
+	checkfill(p, PAGE, 'a', "below the hole");
+	for (i = 2; i < NPAGES; i++) {
+		checkfill(p + i * PAGE, PAGE, 'a' + i, "above the hole");
+	}
+
+	/* Unmapping across the hole takes both pieces. */
+	xmunmap(p, NPAGES * PAGE);
+
+	/* A fresh map is zeroed, whatever was mapped there before. */
+	p = xmmap(NPAGES * PAGE, MAP_PRIVATE | MAP_ANON, -1);
+	checkfill(p, NPAGES * PAGE, 0, "anonymous map again");
+	xmunmap(p, NPAGES * PAGE);
+	printf("mmaptest: anonymous maps ok\n");
+}
+
+/*
+ * Check the file holds page I filled with 'A' + I, except for the
+ * first byte of each page, which is FIRST.
+ */
+static
+void
+checkfile(int fd, int first, const char *what)
+{
+	char buf[PAGE];
+	int i;
+
+	if (lseek(fd, 0, SEEK_SET) < 0) {
+		err(1, "lseek");
+	}
+	for (i = 0; i < NPAGES; i++) {
+		if (read(fd, buf, PAGE) != PAGE) {
+			err(1, "%s: read", what);
+		}
+		if (buf[0] != (char)first) {
+			errx(1, "%s: page %d starts with %d, expected %d",
+			     what, i, buf[0], first);
+		}
+		checkfill(buf + 1, PAGE - 1, 'A' + i, what);
+	}
+}
+
+static
+void
+filetest(void)
+{
+	char buf[PAGE];
+	char *p;
+	int fd, i;
+
+	fd = open(FILENAME, O_RDWR | O_CREAT | O_TRUNC, 0664);
+	if (fd < 0) {
+		err(1, "%s", FILENAME);
+	}
+	for (i = 0; i < NPAGES; i++) {
+		memset(buf, 'A' + i, PAGE);
+		if (write(fd, buf, PAGE) != PAGE) {
+			err(1, "%s: write", FILENAME);
+		}
+	}
+
+	/* Private: the map sees the file, the file never sees the map. */
+	p = xmmap(NPAGES * PAGE, MAP_PRIVATE, fd);
+	for (i = 0; i < NPAGES; i++) {
+		checkfill(p + i * PAGE, PAGE, 'A' + i, "private file map");
+		p[i * PAGE] = 'x';
+	}
+	xmunmap(p, NPAGES * PAGE);
+	checkfile(fd, 'A', "after private map");
+
+	/* Shared: writes reach the file on munmap, hole punched or not. */
+	p = xmmap(NPAGES * PAGE, MAP_SHARED, fd);
+	for (i = 0; i < NPAGES; i++) {
+		p[i * PAGE] = 'y';
+	}
+	xmunmap(p + PAGE, PAGE);
+	xmunmap(p, NPAGES * PAGE);
+	checkfile(fd, 'y', "after shared map");
+	close(fd);
+
+	/* A shared writable map needs a file open for writing too. */
+	fd = open(FILENAME, O_RDONLY);
+	if (fd < 0) {
+		err(1, "%s", FILENAME);
+	}
+	checkbadmap(PAGE, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0, EACCES,
+		    "a read-only file");
+	close(fd);
+	remove(FILENAME);
+	printf("mmaptest: file maps ok\n");
+}
+
+static
+void
+badtest(void)
+{
+	char *p;
+
+	checkbadmap(0, PROT_READ, MAP_PRIVATE | MAP_ANON, -1, 0, EINVAL,
+		    "no length");
+	checkbadmap(PAGE, PROT_READ, MAP_ANON, -1, 0, EINVAL,
+		    "neither MAP_SHARED nor MAP_PRIVATE");
+	checkbadmap(PAGE, PROT_READ, MAP_SHARED | MAP_PRIVATE | MAP_ANON, -1,
+		    0, EINVAL, "both MAP_SHARED and MAP_PRIVATE");
+	checkbadmap(PAGE, PROT_READ, MAP_PRIVATE, -1, 0, EBADF, "no file");
+
+	p = xmmap(PAGE, MAP_PRIVATE | MAP_ANON, -1);
+	checkbadunmap(p + 1, PAGE, "an unaligned address");
+	checkbadunmap(p, 0, "no length");
+	checkbadunmap(p, (size_t)0 - PAGE, "a range that wraps");
+	checkbadunmap((void *)0x80000000, PAGE, "kernel memory");
+	checkbadunmap((void *)(0x80000000 - PAGE), 2 * PAGE,
+		      "a range ending in kernel memory");
+	xmunmap(p, PAGE);
+	printf("mmaptest: bad arguments ok\n");
+}
+
+int
+main(void)
+{
+	anontest();
+	filetest();
+	badtest();
+	printf("mmaptest: passed\n");
+	return 0;
+}
@@ -32,9 +32,15 @@
 #include <lib.h>
 #include <addrspace.h>
 #include <vm.h>
+#include <swap.h>
+#include <pagecache.h>
 #include <proc.h>
 #include <current.h>
 #include <spl.h>
+#include <synch.h>
+#include <uio.h>
+#include <vnode.h>
+#include <kern/mman.h>
 #include <mips/tlb.h>
 
 
@@ -42,181 +48,603 @@ static
 void
 SegmentInit(struct Segment * seg)
 {
-	seg->ptes = NULL;
 	seg->start = 0;
 	seg->bound = 0;
+	seg->readable = false;
+	seg->writeable = false;
+	seg->executable = false;
+	seg->vnode = NULL;
+	seg->offset = 0;
+	seg->filestart = 0;
+	seg->filesize = 0;
+	seg->writeback = false;
 }
 
+static
+bool
+SegmentContains(struct Segment * seg, vaddr_t addr)
+{
+	return addr >= seg->start && addr < (seg->start + seg->bound);
+}
+
+/*
+ * Give back the frames and swap slots of every page from START up to
+ * END. START must be page aligned.
+ */
 static
 void
-SegmentDestroy(struct Segment * seg)
+PagesRelease(struct addrspace * as, vaddr_t start, vaddr_t end)
 {
-	for(struct PteList * h = seg->ptes; h != NULL;) {
-		struct PteList * t = h;
-		h = h->next;
-		free_kpages(t->pte.virtual);
-		kfree(t);
+	struct PageTable * pt = as->pagetable;
+	for(vaddr_t addr = PageTableNext(pt, start, end); addr < end;
+			addr = PageTableNext(pt, addr + PAGE_SIZE, end)) {
+		struct PTE * pte = PageTableFind(pt, addr, false);
+		// The pageout path may still be using the page.
+		SwapWait(pte);
+		if(!pte->valid) {
+			continue;
+		}
+		if(pte->isInMemory) {
+			coremap_unmap(PTE_KVADDR(pte), as, addr);
+		} else {
+			SwapFree(pte);
+		}
+		pte->valid = false;
 	}
 }
 
 static
 void
-SegmentMake(struct Segment * seg)
+SegmentDestroy(struct addrspace * as, struct Segment * seg)
+{
+	PagesRelease(as, seg->start, seg->start + seg->bound);
+	if(seg->vnode != NULL) {
+		VOP_DECREF(seg->vnode);
+		seg->vnode = NULL;
+	}
+}
+
+/*
+ * Fill the already zeroed frame at KADDR with the initial contents of
+ * the page at ADDR: whatever part of it the segment has in its file.
+ */
+static
+int
+PageLoad(struct Segment * seg, vaddr_t kaddr, vaddr_t addr)
 {
-	for(struct PteList * h = seg->ptes; h != NULL; h = h->next) {
-		vaddr_t addr = alloc_kpages_swapable(1);
-		paddr_t paddr = addr - MIPS_KSEG0;
-		h->pte.virtual = addr;
-		h->pte.isInMemory = true;
-		h->pte.swapable = true;
-		h->pte.valid = true;
-		h->pte.physical = paddr;
-		h->pte.useCount = 1;
+	if(seg->vnode == NULL) {
+		return 0;
+	}
+
+	vaddr_t start = MAX(addr, seg->filestart);
+	vaddr_t end = MIN(addr + PAGE_SIZE, seg->filestart + seg->filesize);
+	if(start >= end) {
+		return 0;
+	}
 
-		bzero((void*)addr, PAGE_SIZE);
+	struct iovec iov;
+	struct uio ku;
+	uio_kinit(&iov, &ku, (void*)(kaddr + (start - addr)), end - start,
+			seg->offset + (start - seg->filestart), UIO_READ);
+	int result = VOP_READ(seg->vnode, &ku);
+	if(result) {
+		return result;
+	}
+	if(ku.uio_resid != 0) {
+		kprintf("ELF: short read on segment - file truncated?\n");
+		return ENOEXEC;
+	}
+	return 0;
+}
+
+/*
+ * Put in *RET a frame holding the page at ADDR of a read-only
+ * file-backed segment, with a reference for the caller, from the page
+ * cache if possible. Only pages wholly inside the file data are
+ * cached; one that is partly zeros gets a frame of its own.
+ */
+static
+int
+PageLoadShared(struct Segment * seg, vaddr_t addr, vaddr_t * ret)
+{
+	bool cacheable = addr >= seg->filestart &&
+		addr + PAGE_SIZE <= seg->filestart + seg->filesize;
+	off_t offset = seg->offset + (addr - seg->filestart);
+
+	vaddr_t kaddr = 0;
+	if(cacheable) {
+		kaddr = pagecache_lookup(seg->vnode, offset);
+		if(kaddr != 0) {
+			*ret = kaddr;
+			return 0;
+		}
+	}
+	kaddr = alloc_kpages_zeroed();
+	if(kaddr == 0) {
+		return ENOMEM;
 	}
+	int result = PageLoad(seg, kaddr, addr);
+	if(result) {
+		free_kpages(kaddr);
+		return result;
+	}
+	*ret = cacheable ? pagecache_insert(seg->vnode, offset, kaddr) : kaddr;
+	return 0;
+}
+
+/*
+ * Whether none of the page at ADDR comes from the segment's file, so
+ * it starts out all zeros.
+ */
+static
+bool
+PageIsAnonymous(struct Segment * seg, vaddr_t addr)
+{
+	return seg->vnode == NULL || seg->filesize == 0 ||
+		addr + PAGE_SIZE <= seg->filestart ||
+		addr >= seg->filestart + seg->filesize;
+}
+
+/*
+ * Point PTE at the frame KADDR.
+ */
+static
+void
+PageInstall(struct PTE * pte, struct Segment * seg, vaddr_t kaddr)
+{
+	pte->busy = false;
+	pte->shared = false;
+	pte->valid = true;
+	pte->readable = seg->readable;
+	pte->writeable = seg->writeable;
+	pte->filedirty = false;
+	pte->isInMemory = true;
+	pte->useCount = 1;
+	pte->readahead = false;
+	pte->dirty = true;
+	pte->location = KVADDR_TO_PPN(kaddr);
 }
 
+/*
+ * Move the bottom of the stack down to the page holding ADDR. Nothing
+ * is mapped here; the pages fault in as they are touched.
+ */
 static
 void
-SegmentMakeNoZero(struct Segment * seg)
+ExpandStack(struct addrspace * as, vaddr_t addr)
+{
+	as->stack.start = addr & PAGE_FRAME;
+	as->stack.bound = USERSTACK - as->stack.start;
+	as->stack.readable = true;
+	as->stack.writeable = true;
+	as->stack.executable = false;
+}
+
+/*
+ * Whether a fault at ADDR, below the stack, should grow the stack: it
+ * must be within STACK_MAXPAGES of the top, and leave a gap of at
+ * least STACK_GUARDPAGES above every other segment.
+ */
+static
+bool
+StackCanGrow(struct addrspace * as, vaddr_t addr)
+{
+	if(addr >= as->stack.start || addr < USERSTACK - STACK_MAXPAGES * PAGE_SIZE) {
+		return false;
+	}
+	struct Segment * segs[] = { &as->code, &as->data, &as->heap };
+	for(unsigned i = 0; i != sizeof(segs) / sizeof(segs[0]); i++) {
+		vaddr_t end = segs[i]->start + segs[i]->bound;
+		if(segs[i]->bound != 0 &&
+				(addr & PAGE_FRAME) < end + STACK_GUARDPAGES * PAGE_SIZE) {
+			return false;
+		}
+	}
+	return true;
+}
+
+static
+struct Segment *
+SegmentFind(struct addrspace * as, vaddr_t addr)
 {
-	for(struct PteList * h = seg->ptes; h != NULL; h = h->next) {
-		vaddr_t addr = alloc_kpages_swapable(1);
-		paddr_t paddr = addr - MIPS_KSEG0;
-		h->pte.virtual = addr;
-		h->pte.isInMemory = true;
-		h->pte.swapable = true;
-		h->pte.valid = true;
-		h->pte.physical = paddr;
-		h->pte.useCount = 1;
+	if(SegmentContains(&as->code, addr)) {
+		return &as->code;
+	} else if(SegmentContains(&as->data, addr)) {
+		return &as->data;
+	} else if(SegmentContains(&as->heap, addr)) {
+		return &as->heap;
+	} else if(SegmentContains(&as->stack, addr)) {
+		return &as->stack;
+	}
+	for(unsigned i = 0; i != AS_MAXMAPS; i++) {
+		if(SegmentContains(&as->maps[i], addr)) {
+			return &as->maps[i];
+		}
 	}
+	return NULL;
+}
+
+static
+bool
+SegmentIsMap(struct addrspace * as, struct Segment * seg)
+{
+	return seg >= &as->maps[0] && seg < &as->maps[AS_MAXMAPS];
 }
 
+/*
+ * Map every page of SEG in SRC into DST as well. Both sides become
+ * copy-on-write; see PageUnshare. On failure DST may be left with some
+ * of the pages, and is only fit to be destroyed.
+ */
+static
+int
+SegmentShare(struct addrspace * dst, struct addrspace * src, struct Segment * seg)
+{
+	vaddr_t end = seg->start + seg->bound;
+	for(vaddr_t addr = PageTableNext(src->pagetable, seg->start, end); addr < end;
+			addr = PageTableNext(src->pagetable, addr + PAGE_SIZE, end)) {
+		struct PTE * spte = PageTableFind(src->pagetable, addr, false);
+		SwapWait(spte);
+		if(!spte->valid) {
+			continue;
+		}
+		struct PTE * dpte = PageTableFind(dst->pagetable, addr, true);
+		if(dpte == NULL) {
+			return ENOMEM;
+		}
+		// Bring the source back after allocating, so making room for
+		// the new leaf cannot push it out again. It may have been
+		// dropped altogether if it was read-only.
+		SwapWait(spte);
+		if(!spte->valid) {
+			continue;
+		}
+		if(!spte->isInMemory) {
+			int result = SwapIn(spte);
+			if(result) {
+				return result;
+			}
+			coremap_map(PTE_KVADDR(spte), src, addr);
+		}
+		// Both mappings are recorded, so whichever is left last
+		// owns the frame again. The PTE is filled in first, as the
+		// pageout clock looks at every mapping it knows of.
+		coremap_share(PTE_KVADDR(spte));
+		spte->shared = true;
+		*dpte = *spte;
+		coremap_map(PTE_KVADDR(spte), dst, addr);
+	}
+	return 0;
+}
 
+/*
+ * First write to a shared page: copy it into a frame of its own,
+ * unless every other mapping has already gone away.
+ */
 static
-struct PteList *
-PteList_InsertFront(struct PteList * list, struct PTE * pte)
+int
+PageUnshare(struct addrspace * as, vaddr_t addr, struct PTE * pte)
 {
-	struct PteList * p = kmalloc(sizeof(struct PteList));
-	KASSERT(p != NULL);
-	if(list != NULL) {
-		list->prev = p;
+	KASSERT(pte->shared && pte->isInMemory);
+
+	vaddr_t old = PTE_KVADDR(pte);
+	if(old == coremap_zeropage()) {
+		vaddr_t kaddr = alloc_kpages_zeroed();
+		if(kaddr == 0) {
+			return ENOMEM;
+		}
+		pte->location = KVADDR_TO_PPN(kaddr);
+	} else if(coremap_sharecount(old) > 1) {
+		// Hold on to the old frame while making room, or the pageout
+		// clock could take it if it is in the page cache.
+		coremap_share(old);
+		vaddr_t kaddr = alloc_kpages_swapable(1);
+		if(kaddr == 0) {
+			free_kpages(old);
+			return ENOMEM;
+		}
+		memmove((void *)kaddr, (const void *)old, PAGE_SIZE);
+		pte->location = KVADDR_TO_PPN(kaddr);
+		coremap_unmap(old, as, addr);
+		free_kpages(old);
 	}
-	p->next = list;
-	p->prev = NULL;
-	memcpy(&p->pte, pte, sizeof(*pte));
-	return p;
+	pte->shared = false;
+	return 0;
 }
 
+/*
+ * Write the pages of a shared file mapping that fall in START..END and
+ * have been written since they were read from its file back to it.
+ */
 static
-struct PteList *
-PteList_Append(struct PteList * list, struct PTE * pte)
+int
+MapWriteBack(struct addrspace * as, struct Segment * seg, vaddr_t start, vaddr_t end)
 {
-	struct PteList * tail = list;
-	while(tail && tail->next != NULL) {
-		tail = tail->next;
+	if(!seg->writeback) {
+		return 0;
+	}
+	end = MIN(end, seg->filestart + seg->filesize);
+
+	bool wrote = false;
+	struct PageTable * pt = as->pagetable;
+	for(vaddr_t addr = PageTableNext(pt, start, end); addr < end;
+			addr = PageTableNext(pt, addr + PAGE_SIZE, end)) {
+		struct PTE * pte = PageTableFind(pt, addr, false);
+		SwapWait(pte);
+		if(!pte->valid || !pte->filedirty) {
+			continue;
+		}
+		if(!pte->isInMemory) {
+			int result = SwapIn(pte);
+			if(result) {
+				return result;
+			}
+			coremap_map(PTE_KVADDR(pte), as, addr);
+		}
+		// The write may allocate, and the pageout clock must not take
+		// the frame from under it.
+		vaddr_t kaddr = PTE_KVADDR(pte);
+		coremap_share(kaddr);
+		struct iovec iov;
+		struct uio ku;
+		uio_kinit(&iov, &ku, (void*)kaddr, MIN(PAGE_SIZE, end - addr),
+				seg->offset + (addr - seg->filestart), UIO_WRITE);
+		int result = VOP_WRITE(seg->vnode, &ku);
+		free_kpages(kaddr);
+		if(result) {
+			return result;
+		}
+		wrote = true;
 	}
-	struct PteList * p = kmalloc(sizeof(struct PteList));
-	p->prev = tail;
-	p->next = NULL;
-	if(tail != NULL) {
-		tail->next = p;
+	if(wrote) {
+		pagecache_purge(seg->vnode);
 	}
-	memcpy(&p->pte, pte, sizeof(*pte));
-	return list? list : p;
+	return 0;
+}
+
+/*
+ * Drop the part of mapping SEG below ADDR.
+ */
+static
+void
+MapAdvance(struct Segment * seg, vaddr_t addr)
+{
+	size_t skip = addr - seg->start;
+	seg->start = addr;
+	seg->bound -= skip;
+	seg->offset += skip;
+	seg->filestart = addr;
+	seg->filesize = seg->filesize > skip ? seg->filesize - skip : 0;
 }
 
+/*
+ * Drop the part of mapping SEG from ADDR up.
+ */
 static
 void
-ExpandStack(struct addrspace * as, vaddr_t addr, size_t sz)
-{
-	KASSERT(sz == PAGE_SIZE);
-	as->stack.start = addr;
-	as->stack.bound += sz;
-	struct PTE pte;
-	pte.swapable = false;
-	pte.shared = false;
-	pte.isInMemory = false;
-	pte.executable = false;
-	pte.readable = true;
-	pte.writeable = true;
-	pte.valid = false;
-	pte.location = 0;
-	pte.physical = 0;
-	pte.virtual = as->stack.start;
-	pte.useCount = 0;
-	pte.pid = curthread->t_proc->p_pid;
-	as->stack.ptes = PteList_InsertFront(as->stack.ptes, &pte);
-
-	SegmentMake(&as->stack);
+MapTruncate(struct Segment * seg, vaddr_t addr)
+{
+	seg->bound = addr - seg->start;
+	seg->filesize = MIN(seg->filesize, seg->bound);
 }
 
 static
-struct PTE *
-SegmentFindAddr(struct Segment * seg, vaddr_t addr)
+struct Segment *
+MapOverlapping(struct addrspace * as, vaddr_t start, vaddr_t end)
 {
-	if(!(addr >= (seg->start) && addr < (seg->start + seg->bound))) {
-		return NULL;
+	for(unsigned i = 0; i != AS_MAXMAPS; i++) {
+		struct Segment * m = &as->maps[i];
+		if(m->bound != 0 && m->start < end && start < m->start + m->bound) {
+			return m;
+		}
 	}
-	struct PTE * pte = NULL;
-	vaddr_t start = seg->start;
-	for(struct PteList * h = seg->ptes; h != NULL; h = h->next) {
-		if(start == addr) {
-			pte = &h->pte;
-			break;
-		} else {
-			start += PAGE_SIZE;
+	return NULL;
+}
+
+static
+struct Segment *
+MapSlot(struct addrspace * as)
+{
+	for(unsigned i = 0; i != AS_MAXMAPS; i++) {
+		if(as->maps[i].bound == 0) {
+			return &as->maps[i];
 		}
 	}
-	return pte;
+	return NULL;
 }
 
+/*
+ * The lowest address taken by a mapping; the heap must stay below it.
+ */
 static
-void
-SegmentPreCopy(struct Segment * dst, struct Segment * src)
+vaddr_t
+MapsBottom(struct addrspace * as)
+{
+	vaddr_t bottom = HEAP_TOP;
+	for(unsigned i = 0; i != AS_MAXMAPS; i++) {
+		if(as->maps[i].bound != 0 && as->maps[i].start < bottom) {
+			bottom = as->maps[i].start;
+		}
+	}
+	return bottom;
+}
+
+/*
+ * Find LEN free bytes between the heap and HEAP_TOP: at HINT if it
+ * is free, else as high up as possible. Returns 0 if there is no room.
+ */
+static
+vaddr_t
+MapPlace(struct addrspace * as, vaddr_t hint, size_t len)
 {
-	dst->start = src->start;
-	dst->bound = src->bound;
-	for(struct PteList * h = src->ptes; h != NULL; h = h->next) {
-		struct PTE pte;
-		memcpy(&pte, &h->pte, sizeof(struct PTE));
-		dst->ptes = PteList_Append(dst->ptes, &pte);
+	vaddr_t low = ROUNDUP(as->heap.start + as->heap.bound, PAGE_SIZE);
+	if(hint >= low && hint <= HEAP_TOP && len <= HEAP_TOP - hint &&
+			MapOverlapping(as, hint, hint + len) == NULL) {
+		return hint;
+	}
+
+	vaddr_t end = HEAP_TOP;
+	while(end >= low && end - low >= len) {
+		struct Segment * m = MapOverlapping(as, end - len, end);
+		if(m == NULL) {
+			return end - len;
+		}
+		// Whatever is free above M is too small.
+		end = m->start;
 	}
+	return 0;
 }
 
+/*
+ * Remove the part of mapping SEG that lies in START..END. If that
+ * punches a hole, the caller has made sure there is a free slot for
+ * the part above it.
+ */
 static
 void
-SegmentCopy(struct Segment * dst, struct Segment * src)
+MapUnmap(struct addrspace * as, struct Segment * seg, vaddr_t start, vaddr_t end)
 {
-	for(struct PteList * h = src->ptes, * d = dst->ptes; h != NULL; h = h->next, d = d->next) {
-		memmove((void *)PADDR_TO_KVADDR(d->pte.physical),
-				(const void*)PADDR_TO_KVADDR(h->pte.physical), PAGE_SIZE);
+	vaddr_t segend = seg->start + seg->bound;
+	start = MAX(start, seg->start);
+	end = MIN(end, segend);
+	if(start >= end) {
+		return;
+	}
+	PagesRelease(as, start, end);
+
+	if(start > seg->start && end < segend) {
+		struct Segment * upper = MapSlot(as);
+		KASSERT(upper != NULL);
+		*upper = *seg;
+		if(upper->vnode != NULL) {
+			VOP_INCREF(upper->vnode);
+		}
+		MapAdvance(upper, end);
+	}
+	if(start > seg->start) {
+		MapTruncate(seg, start);
+	} else if(end < segend) {
+		MapAdvance(seg, end);
+	} else {
+		SegmentDestroy(as, seg);
+		SegmentInit(seg);
 	}
 }
 
-struct PTE *
-as_pagefault(struct addrspace * as, vaddr_t addr)
+int
+as_pagefault(struct addrspace * as, vaddr_t addr, int faulttype, struct PTE ** ret)
 {
-	struct PTE * pte = NULL;
+	int result;
+	struct Segment * seg = SegmentFind(as, addr);
+	if(seg == NULL) {
+		if(!StackCanGrow(as, addr)) {
+			return EFAULT;
+		}
+		ExpandStack(as, addr);
+		seg = &as->stack;
+	}
 
-	if((pte = SegmentFindAddr(&as->code, addr)) != NULL) {
-		;
-	} else if((pte = SegmentFindAddr(&as->data, addr)) != NULL) {
-		;
-	} else if((pte = SegmentFindAddr(&as->heap, addr)) != NULL) {
-		;
-	} else if((pte = SegmentFindAddr(&as->stack, addr)) != NULL) {
-		;
-	} else {
-		kprintf("Need Expand Stack...\n");
-		KASSERT(addr < as->stack.start && addr >= (as->stack.start - PAGE_SIZE));
-		ExpandStack(as, as->stack.start - PAGE_SIZE, PAGE_SIZE);
-		pte = SegmentFindAddr(&as->stack, addr);
-		
-		KASSERT(pte != NULL);
+	if(faulttype != VM_FAULT_READ && !seg->writeable) {
+		return EFAULT;
+	}
+	if(faulttype == VM_FAULT_READ && !seg->readable) {
+		// PROT_NONE, or a mapping without PROT_READ. The TLB cannot
+		// refuse reads of a page it maps, so this only holds until
+		// the page is first written.
+		return EFAULT;
+	}
+
+	struct PTE * pte = PageTableFind(as->pagetable, addr, false);
+	if(pte != NULL) {
+		// Being evicted: wait until it is out, then fault it back.
+		SwapWait(pte);
+	}
+	if((pte == NULL || !pte->valid) &&
+			faulttype == VM_FAULT_READ && PageIsAnonymous(seg, addr)) {
+		// Read before it was ever written: map the zero page
+		// copy-on-write, and only give it a frame on the first write.
+		pte = PageTableFind(as->pagetable, addr, true);
+		if(pte == NULL) {
+			return ENOMEM;
+		}
+		PageInstall(pte, seg, coremap_zeropage());
+		pte->shared = true;
+	} else if((pte == NULL || !pte->valid) && seg->vnode != NULL &&
+			(!seg->writeable || (faulttype == VM_FAULT_READ &&
+				SegmentIsMap(as, seg) && !seg->writeback))) {
+		// Read-only file data, e.g. text or a private mapping that
+		// has not been written yet: share one copy with everybody
+		// else using the same file.
+		vaddr_t kaddr;
+		result = PageLoadShared(seg, addr, &kaddr);
+		if(result) {
+			return result;
+		}
+		pte = PageTableFind(as->pagetable, addr, true);
+		if(pte == NULL) {
+			free_kpages(kaddr);
+			return ENOMEM;
+		}
+		PageInstall(pte, seg, kaddr);
+		pte->shared = true;
+	} else if(pte == NULL || !pte->valid) {
+		// First touch of this page. Fill the frame before the page
+		// table can see it, so it cannot be swapped out half-read.
+		vaddr_t kaddr = alloc_kpages_zeroed();
+		if(kaddr == 0) {
+			return ENOMEM;
+		}
+		result = PageLoad(seg, kaddr, addr);
+		if(result) {
+			free_kpages(kaddr);
+			return result;
+		}
+		pte = PageTableFind(as->pagetable, addr, true);
+		if(pte == NULL) {
+			free_kpages(kaddr);
+			return ENOMEM;
+		}
+		PageInstall(pte, seg, kaddr);
+		if(seg->writeback) {
+			// Read-only in the TLB until written, so a page the
+			// same as its file need not be written back to it.
+			pte->dirty = faulttype != VM_FAULT_READ;
+			pte->filedirty = pte->dirty;
+		}
+	} else if(!pte->isInMemory) {
+		result = SwapInCluster(as, addr, seg->start + seg->bound);
+		if(result) {
+			return result;
+		}
+	} else if(pte->readahead) {
+		pte->readahead = false;
+		swap_readahead_hit();
+	}
+	if(faulttype == VM_FAULT_READONLY) {
+		// A write to a page mapped read-only: either copy-on-write,
+		// or the first write since it was read from swap.
+		if(!pte->writeable) {
+			return EFAULT;
+		}
+		if(pte->shared) {
+			result = PageUnshare(as, addr, pte);
+			if(result) {
+				return result;
+			}
+		}
+		pte->dirty = true;
+		pte->filedirty = true;
+		uint32_t slot = coremap_takeslot(PTE_KVADDR(pte));
+		if(slot != SWAP_NOSLOT) {
+			SwapSlotFree(slot);
+		}
+	} else if(pte->shared && coremap_sharecount(PTE_KVADDR(pte)) == 1) {
+		// Every other mapping has gone away; the frame is ours.
+		pte->shared = false;
 	}
-	return pte;
+	coremap_map(PTE_KVADDR(pte), as, addr);
+	*ret = pte;
+	return 0;
 }
 
 /*
@@ -238,10 +666,24 @@ as_create(void)
 	/*
 	 * Initialize as needed.
 	 */
+	as->pagetable = PageTableCreate();
+	if (as->pagetable == NULL) {
+		kfree(as);
+		return NULL;
+	}
+	as->lock = lock_create("addrspace");
+	if (as->lock == NULL) {
+		PageTableDestroy(as->pagetable);
+		kfree(as);
+		return NULL;
+	}
 	SegmentInit(&as->code);
 	SegmentInit(&as->data);
 	SegmentInit(&as->heap);
 	SegmentInit(&as->stack);
+	as->asid = 0;
+	as->asidgen = 0;
+	as->cpumask = 0;
 
 	return as;
 }
@@ -259,20 +701,47 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 	/*
 	 * Write this.
 	 */
-	SegmentPreCopy(&newas->code, &old->code);
-	SegmentPreCopy(&newas->data, &old->data);
-	SegmentPreCopy(&newas->heap, &old->heap);
-	SegmentPreCopy(&newas->stack, &old->stack);
+	newas->code = old->code;
+	newas->data = old->data;
+	newas->heap = old->heap;
+	newas->stack = old->stack;
+	if(newas->code.vnode != NULL) {
+		VOP_INCREF(newas->code.vnode);
+	}
+	if(newas->data.vnode != NULL) {
+		VOP_INCREF(newas->data.vnode);
+	}
+	for(unsigned i = 0; i != AS_MAXMAPS; i++) {
+		newas->maps[i] = old->maps[i];
+		// The child gets a private copy; only the parent writes back.
+		newas->maps[i].writeback = false;
+		if(newas->maps[i].vnode != NULL) {
+			VOP_INCREF(newas->maps[i].vnode);
+		}
+	}
 
-	SegmentMakeNoZero(&newas->code);
-	SegmentMakeNoZero(&newas->data);
-	SegmentMakeNoZero(&newas->heap);
-	SegmentMakeNoZero(&newas->stack);
+	// Nobody else can be waiting for the new lock, so taking it
+	// second cannot deadlock.
+	lock_acquire(old->lock);
+	lock_acquire(newas->lock);
+	struct Segment * segs[] = { &newas->code, &newas->data, &newas->heap, &newas->stack };
+	int result = 0;
+	for(unsigned i = 0; result == 0 && i != sizeof(segs) / sizeof(segs[0]); i++) {
+		result = SegmentShare(newas, old, segs[i]);
+	}
+	for(unsigned i = 0; result == 0 && i != AS_MAXMAPS; i++) {
+		result = SegmentShare(newas, old, &newas->maps[i]);
+	}
 
-	SegmentCopy(&newas->code, &old->code);
-	SegmentCopy(&newas->data, &old->data);
-	SegmentCopy(&newas->heap, &old->heap);
-	SegmentCopy(&newas->stack, &old->stack);
+	// The parent may still hold writable TLB entries for pages that
+	// are now shared, even if not all of them made it.
+	vm_tlbflush_as(old);
+	lock_release(newas->lock);
+	lock_release(old->lock);
+	if(result) {
+		as_destroy(newas);
+		return result;
+	}
 
 	*ret = newas;
 	return 0;
@@ -284,10 +753,21 @@ as_destroy(struct addrspace *as)
 	/*
 	 * Clean up as needed.
 	 */
-	SegmentDestroy(&as->code);
-	SegmentDestroy(&as->data);
-	SegmentDestroy(&as->heap);
-	SegmentDestroy(&as->stack);
+	lock_acquire(as->lock);
+	SegmentDestroy(as, &as->code);
+	SegmentDestroy(as, &as->data);
+	SegmentDestroy(as, &as->heap);
+	SegmentDestroy(as, &as->stack);
+	for(unsigned i = 0; i != AS_MAXMAPS; i++) {
+		// Nobody is left to report a failed write to.
+		MapWriteBack(as, &as->maps[i],
+				as->maps[i].start, as->maps[i].start + as->maps[i].bound);
+		SegmentDestroy(as, &as->maps[i]);
+	}
+	// Every mapping is gone, so the pageout clock cannot find us now.
+	lock_release(as->lock);
+	lock_destroy(as->lock);
+	PageTableDestroy(as->pagetable);
 
 	kfree(as);
 }
@@ -329,47 +809,21 @@ as_define_region(struct addrspace *as, vaddr_t vaddr, size_t sz,
 	/* ...and now the length. */
 	npages = (sz + PAGE_SIZE - 1) / PAGE_SIZE;
 
-	if(as->code.ptes == NULL) {
-		as->code.start = vaddr;
-		as->code.bound = sz;
-		for(uint32_t i = 0; i != npages; ++i) {
-			struct PTE pte;
-			pte.swapable = false;
-			pte.shared = false;
-			pte.isInMemory = false;
-			pte.executable = (bool)executable;
-			pte.readable = (bool)readable;
-			pte.writeable = (bool)writeable;
-			pte.valid = false;
-			pte.location = 0;
-			pte.physical = 0;
-			pte.virtual = vaddr + i * PAGE_SIZE;
-			pte.useCount = 0;
-			pte.pid = curthread->t_proc->p_pid;
-			as->code.ptes = PteList_Append(as->code.ptes, &pte);
-		}
-		return 0;
+	struct Segment * seg;
+	if(as->code.bound == 0) {
+		seg = &as->code;
+	} else if(as->data.bound == 0) {
+		seg = &as->data;
+	} else {
+		seg = NULL;
 	}
 
-	if(as->data.ptes == NULL) {
-		as->data.start = vaddr;
-		as->data.bound = sz;
-		for(uint32_t i = 0; i != npages; ++i) {
-			struct PTE pte;
-			pte.swapable = false;
-			pte.shared = false;
-			pte.isInMemory = true;
-			pte.executable = (bool)executable;
-			pte.readable = (bool)readable;
-			pte.writeable = (bool)writeable;
-			pte.valid = false;
-			pte.location = 0;
-			pte.physical = 0;
-			pte.virtual = vaddr + i * PAGE_SIZE;
-			pte.useCount = 0;
-			pte.pid = curthread->t_proc->p_pid;
-			as->data.ptes = PteList_Append(as->data.ptes, &pte);
-		}
+	if(seg != NULL) {
+		seg->start = vaddr;
+		seg->bound = npages * PAGE_SIZE;
+		seg->readable = (bool)readable;
+		seg->writeable = (bool)writeable;
+		seg->executable = (bool)executable;
 		return 0;
 	}
 
@@ -385,10 +839,31 @@ as_prepare_load(struct addrspace *as)
 {
 	/*
 	 * Write this.
+	 *
+	 * Nothing to allocate up front: pages are filled from the
+	 * executable or with zeros on their first fault.
 	 */
-	SegmentMake(&as->code);
-	SegmentMake(&as->data);
+	(void)as;
+	return 0;
+}
+
+int
+as_define_file(struct addrspace *as, vaddr_t vaddr,
+	       struct vnode *v, off_t offset, size_t filesize)
+{
+	struct Segment * seg = SegmentFind(as, vaddr);
+	if(seg == NULL || seg->vnode != NULL) {
+		return EINVAL;
+	}
+	if(vaddr + filesize > seg->start + seg->bound) {
+		return EINVAL;
+	}
 
+	VOP_INCREF(v);
+	seg->vnode = v;
+	seg->offset = offset;
+	seg->filestart = vaddr;
+	seg->filesize = filesize;
 	return 0;
 }
 
@@ -396,10 +871,52 @@ int
 as_complete_load(struct addrspace *as)
 {
 	/*
-	 * Write this.
+	 * The heap starts out empty on the first page past the loaded
+	 * segments and is grown by sbrk.
 	 */
+	vaddr_t end = as->code.start + as->code.bound;
+	if(as->data.start + as->data.bound > end) {
+		end = as->data.start + as->data.bound;
+	}
+	as->heap.start = ROUNDUP(end, PAGE_SIZE);
+	as->heap.bound = 0;
+	as->heap.readable = true;
+	as->heap.writeable = true;
+	as->heap.executable = false;
+	return 0;
+}
 
-	(void)as;
+int
+as_sbrk(struct addrspace *as, intptr_t amount, vaddr_t *oldbreak)
+{
+	struct Segment * heap = &as->heap;
+	vaddr_t brk = heap->start + heap->bound;
+	// Negated in unsigned arithmetic, which INTPTR_MIN survives.
+	size_t size = amount < 0 ? (size_t)0 - (size_t)amount : (size_t)amount;
+
+	if(amount < 0 && size > heap->bound) {
+		return EINVAL;
+	}
+	if(amount > 0 && size > MapsBottom(as) - brk) {
+		return ENOMEM;
+	}
+
+	vaddr_t newbrk = amount < 0 ? brk - size : brk + size;
+	if(newbrk < brk) {
+		// Drop the pages wholly above the new break. Nothing else in
+		// this address space runs until we return, so retiring its
+		// TLB entries first is enough.
+		vaddr_t first = ROUNDUP(newbrk, PAGE_SIZE);
+		if(first < brk) {
+			lock_acquire(as->lock);
+			vm_tlbflush_as(as);
+			PagesRelease(as, first, brk);
+			lock_release(as->lock);
+		}
+	}
+	// Growing maps nothing: new pages are zero-filled on first touch.
+	heap->bound = newbrk - heap->start;
+	*oldbreak = brk;
 	return 0;
 }
 
@@ -409,9 +926,97 @@ as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 	/* Initial user-level stack pointer */
 	*stackptr = USERSTACK;
 
-	vaddr_t addr = USERSTACK;
-	ExpandStack(as, addr -= PAGE_SIZE, PAGE_SIZE);
+	ExpandStack(as, USERSTACK - PAGE_SIZE);
 
 	return 0;
 }
 
+int
+as_mmap(struct addrspace *as, vaddr_t addr, size_t len, int prot,
+	struct vnode *vn, off_t offset, size_t filesize, bool writeback,
+	vaddr_t *ret)
+{
+	if(len == 0 || len > HEAP_TOP) {
+		return EINVAL;
+	}
+	len = ROUNDUP(len, PAGE_SIZE);
+
+	struct Segment * seg = MapSlot(as);
+	if(seg == NULL) {
+		return ENOMEM;
+	}
+	addr = MapPlace(as, addr & PAGE_FRAME, len);
+	if(addr == 0) {
+		return ENOMEM;
+	}
+
+	SegmentInit(seg);
+	seg->start = addr;
+	seg->bound = len;
+	seg->readable = (prot & PROT_READ) != 0;
+	seg->writeable = (prot & PROT_WRITE) != 0;
+	seg->executable = (prot & PROT_EXEC) != 0;
+	if(vn != NULL) {
+		VOP_INCREF(vn);
+		seg->vnode = vn;
+		seg->offset = offset;
+		seg->filestart = addr;
+		seg->filesize = MIN(filesize, len);
+		seg->writeback = writeback;
+	}
+	*ret = addr;
+	return 0;
+}
+
+int
+as_munmap(struct addrspace *as, vaddr_t addr, size_t len)
+{
+	if((addr & ~(vaddr_t)PAGE_FRAME) != 0 || len == 0 || addr + len < addr ||
+			addr + len > USERSPACETOP) {
+		return EINVAL;
+	}
+	// Cannot wrap: USERSPACETOP is page aligned.
+	vaddr_t end = ROUNDUP(addr + len, PAGE_SIZE);
+
+	lock_acquire(as->lock);
+
+	// Everything that can fail is done before anything is torn down,
+	// so an error leaves every mapping as it was: each hole punched
+	// needs a free slot, and shared file pages go back to their file.
+	unsigned holes = 0, slots = 0;
+	for(unsigned i = 0; i != AS_MAXMAPS; i++) {
+		struct Segment * m = &as->maps[i];
+		if(m->bound == 0) {
+			slots++;
+		} else if(m->start < addr && end < m->start + m->bound) {
+			holes++;
+		}
+	}
+	if(holes > slots) {
+		lock_release(as->lock);
+		return ENOMEM;
+	}
+	for(unsigned i = 0; i != AS_MAXMAPS; i++) {
+		struct Segment * m = &as->maps[i];
+		if(m->bound == 0) {
+			continue;
+		}
+		int result = MapWriteBack(as, m, MAX(addr, m->start),
+				MIN(end, m->start + m->bound));
+		if(result) {
+			lock_release(as->lock);
+			return result;
+		}
+	}
+
+	// As in as_sbrk, nothing else runs in this address space before
+	// we return, so one flush up front covers every page freed.
+	vm_tlbflush_as(as);
+	for(unsigned i = 0; i != AS_MAXMAPS; i++) {
+		if(as->maps[i].bound != 0) {
+			MapUnmap(as, &as->maps[i], addr, end);
+		}
+	}
+	lock_release(as->lock);
+	return 0;
+}
@@ -0,0 +1,264 @@
+#include <types.h>
+#include <lib.h>
+#include <synch.h>
+#include <thread.h>
+#include <vnode.h>
+#include <vm.h>
+#include <pagecache.h>
+
+#define PAGECACHE_BUCKETS	64
+
+struct CachedPage {
+	struct vnode * vnode;
+	off_t offset;
+	vaddr_t kaddr;
+	struct CachedPage * next;
+};
+
+static struct CachedPage * buckets[PAGECACHE_BUCKETS];
+
+/*
+ * Count of cached pages for each hash of the vnode alone, so purging a
+ * file with nothing cached, e.g. on every write, is one load and needs
+ * no lock. Vnodes that share a slot only cost a needless scan. Changed
+ * under pagecache_lock.
+ */
+static unsigned vnode_pages[PAGECACHE_BUCKETS];
+
+static struct lock * pagecache_lock = NULL;
+static unsigned reclaim_hand = 0;       // bucket pagecache_reclaim starts at
+
+/*
+ * Pages reclaimed to make room still hold their vnodes. Dropping the
+ * last reference to a vnode can take file system locks the allocating
+ * thread may already hold, so the pagecache thread does it instead,
+ * when release_sem is raised. Kept under pagecache_lock.
+ */
+static struct CachedPage * releasing = NULL;
+static struct semaphore * release_sem = NULL;
+
+static
+unsigned
+PageCacheHash(struct vnode * vn, off_t offset)
+{
+	uint32_t h = (uint32_t)(uintptr_t)vn ^ (uint32_t)(offset >> 12);
+	h ^= h >> 16;
+	return (h * 2654435761U) % PAGECACHE_BUCKETS;
+}
+
+static
+unsigned
+VnodeHash(struct vnode * vn)
+{
+	return ((uint32_t)(uintptr_t)vn * 2654435761U) % PAGECACHE_BUCKETS;
+}
+
+static
+struct CachedPage *
+PageCacheFind(struct vnode * vn, off_t offset)
+{
+	struct CachedPage * cp = buckets[PageCacheHash(vn, offset)];
+	for(; cp != NULL; cp = cp->next) {
+		if(cp->vnode == vn && cp->offset == offset) {
+			return cp;
+		}
+	}
+	return NULL;
+}
+
+void
+pagecache_bootstrap(void)
+{
+	for(unsigned i = 0; i != PAGECACHE_BUCKETS; i++) {
+		buckets[i] = NULL;
+		vnode_pages[i] = 0;
+	}
+	pagecache_lock = lock_create("pagecache");
+	KASSERT(pagecache_lock != NULL);
+}
+
+vaddr_t
+pagecache_lookup(struct vnode * vn, off_t offset)
+{
+	vaddr_t kaddr = 0;
+	lock_acquire(pagecache_lock);
+	struct CachedPage * cp = PageCacheFind(vn, offset);
+	if(cp != NULL) {
+		coremap_share(cp->kaddr);
+		kaddr = cp->kaddr;
+	}
+	lock_release(pagecache_lock);
+	return kaddr;
+}
+
+vaddr_t
+pagecache_insert(struct vnode * vn, off_t offset, vaddr_t kaddr)
+{
+	// Allocate first: making room may call pagecache_reclaim.
+	struct CachedPage * cp = kmalloc(sizeof(struct CachedPage));
+	if(cp == NULL) {
+		// Just don't cache it.
+		return kaddr;
+	}
+
+	lock_acquire(pagecache_lock);
+	struct CachedPage * old = PageCacheFind(vn, offset);
+	if(old != NULL) {
+		coremap_share(old->kaddr);
+		vaddr_t ret = old->kaddr;
+		lock_release(pagecache_lock);
+		kfree(cp);
+		free_kpages(kaddr);
+		return ret;
+	}
+
+	VOP_INCREF(vn);
+	cp->vnode = vn;
+	cp->offset = offset;
+	cp->kaddr = kaddr;
+	unsigned b = PageCacheHash(vn, offset);
+	cp->next = buckets[b];
+	buckets[b] = cp;
+	vnode_pages[VnodeHash(vn)]++;
+	// One reference for the cache, one for the caller.
+	coremap_share(kaddr);
+	coremap_setcached(kaddr, true);
+	lock_release(pagecache_lock);
+	return kaddr;
+}
+
+/*
+ * Drop the cache's references to the frames on the list FREED. Called
+ * without pagecache_lock, since freeing may take memalloc_lock. The
+ * vnodes are let go of here too, or with DEFER by the pagecache thread.
+ */
+static
+void
+PageCacheRelease(struct CachedPage * freed, bool defer)
+{
+	struct CachedPage * last = NULL;
+	for(struct CachedPage * cp = freed; cp != NULL; cp = cp->next) {
+		coremap_setcached(cp->kaddr, false);
+		free_kpages(cp->kaddr);
+		last = cp;
+	}
+	if(defer && last != NULL) {
+		lock_acquire(pagecache_lock);
+		last->next = releasing;
+		releasing = freed;
+		lock_release(pagecache_lock);
+		if(release_sem != NULL) {
+			V(release_sem);
+		}
+		return;
+	}
+	while(freed != NULL) {
+		struct CachedPage * cp = freed;
+		freed = cp->next;
+		VOP_DECREF(cp->vnode);
+		kfree(cp);
+	}
+}
+
+static
+void
+PageCacheThread(void * data1, unsigned long data2)
+{
+	(void)data1;
+	(void)data2;
+	while(true) {
+		P(release_sem);
+		lock_acquire(pagecache_lock);
+		struct CachedPage * freed = releasing;
+		releasing = NULL;
+		lock_release(pagecache_lock);
+
+		while(freed != NULL) {
+			struct CachedPage * cp = freed;
+			freed = cp->next;
+			VOP_DECREF(cp->vnode);
+			kfree(cp);
+		}
+	}
+}
+
+void
+pagecache_threadbootstrap(void)
+{
+	release_sem = sem_create("pagecache", 0);
+	KASSERT(release_sem != NULL);
+	if(thread_fork("pagecache", NULL, PageCacheThread, NULL, 0) != 0) {
+		panic("Couldn't start pagecache thread\n");
+	}
+	// Anything reclaimed before now.
+	V(release_sem);
+}
+
+bool
+pagecache_reclaim(unsigned want)
+{
+	struct CachedPage * freed = NULL;
+	unsigned n = 0;
+
+	if(pagecache_lock == NULL || lock_do_i_hold(pagecache_lock)) {
+		return false;
+	}
+	lock_acquire(pagecache_lock);
+	// Go on from where the last call stopped, so the same buckets
+	// are not emptied over and over.
+	for(unsigned k = 0; k != PAGECACHE_BUCKETS && n != want; k++) {
+		unsigned i = reclaim_hand;
+		struct CachedPage ** pp = &buckets[i];
+		while(*pp != NULL && n != want) {
+			struct CachedPage * cp = *pp;
+			if(coremap_sharecount(cp->kaddr) == 1) {
+				*pp = cp->next;
+				vnode_pages[VnodeHash(cp->vnode)]--;
+				cp->next = freed;
+				freed = cp;
+				n++;
+			} else {
+				pp = &cp->next;
+			}
+		}
+		if(*pp == NULL) {
+			reclaim_hand = (i + 1) % PAGECACHE_BUCKETS;
+		}
+	}
+	lock_release(pagecache_lock);
+
+	PageCacheRelease(freed, true);
+	return n > 0;
+}
+
+void
+pagecache_purge(struct vnode * vn)
+{
+	struct CachedPage * freed = NULL;
+	unsigned * count = &vnode_pages[VnodeHash(vn)];
+
+	// Looked at without the lock: a page of VN being inserted right
+	// now races with the caller's change whether we take it or not.
+	if(*count == 0) {
+		return;
+	}
+	lock_acquire(pagecache_lock);
+	for(unsigned i = 0; i != PAGECACHE_BUCKETS && *count != 0; i++) {
+		struct CachedPage ** pp = &buckets[i];
+		while(*pp != NULL) {
+			struct CachedPage * cp = *pp;
+			if(cp->vnode == vn) {
+				*pp = cp->next;
+				(*count)--;
+				cp->next = freed;
+				freed = cp;
+			} else {
+				pp = &cp->next;
+			}
+		}
+	}
+	lock_release(pagecache_lock);
+
+	// Pages still mapped keep their old contents until unmapped.
+	PageCacheRelease(freed, false);
+}
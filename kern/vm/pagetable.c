@@ -0,0 +1,65 @@
+#include <types.h>
+#include <lib.h>
+#include <vm.h>
+#include <pagetable.h>
+
+struct PageTable *
+PageTableCreate(void)
+{
+	COMPILE_ASSERT(sizeof(struct PTE) == sizeof(uint32_t));
+	COMPILE_ASSERT(PT_LEAFSIZE * sizeof(struct PTE) == PAGE_SIZE);
+
+	struct PageTable * pt = kmalloc(sizeof(struct PageTable));
+	if(pt == NULL) {
+		return NULL;
+	}
+	for(uint32_t i = 0; i != PT_DIRSIZE; ++i) {
+		pt->leaves[i] = NULL;
+	}
+	return pt;
+}
+
+void
+PageTableDestroy(struct PageTable * pt)
+{
+	KASSERT(pt != NULL);
+	for(uint32_t i = 0; i != PT_DIRSIZE; ++i) {
+		if(pt->leaves[i] != NULL) {
+			free_kpages((vaddr_t)pt->leaves[i]);
+		}
+	}
+	kfree(pt);
+}
+
+struct PTE *
+PageTableFind(struct PageTable * pt, vaddr_t addr, bool create)
+{
+	KASSERT(addr < USERSPACETOP);
+
+	struct PTE * leaf = pt->leaves[PT_DIRINDEX(addr)];
+	if(leaf == NULL) {
+		if(!create) {
+			return NULL;
+		}
+		vaddr_t page = alloc_kpages(1);
+		if(page == 0) {
+			return NULL;
+		}
+		bzero((void*)page, PAGE_SIZE);
+		leaf = (struct PTE *)page;
+		pt->leaves[PT_DIRINDEX(addr)] = leaf;
+	}
+	return &leaf[PT_LEAFINDEX(addr)];
+}
+
+vaddr_t
+PageTableNext(struct PageTable * pt, vaddr_t addr, vaddr_t end)
+{
+	KASSERT(end <= USERSPACETOP);
+
+	while(addr < end && pt->leaves[PT_DIRINDEX(addr)] == NULL) {
+		// On to the start of the next leaf.
+		addr = (addr | ((PT_LEAFSIZE << PTE_PAGESHIFT) - 1)) + 1;
+	}
+	return MIN(addr, end);
+}
@@ -0,0 +1,293 @@
+#include <types.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <spl.h>
+#include <cpu.h>
+#include <current.h>
+#include <vm.h>
+#include <slab.h>
+
+/*
+ * A slab is one page: this header, the stack of its free object
+ * numbers, then the objects. A slab with no free objects is on no
+ * list; one with some is on the cache's partial list; a wholly free
+ * one is kept as the cache's spare, or given back if there already is
+ * one. Any object finds its slab by rounding down to the page.
+ *
+ * Each CPU's free objects sit in a magazine, used with interrupts off.
+ * An empty magazine is refilled, and a full one drained, by half,
+ * under the cache lock.
+ */
+#define SLAB_MAXCPUS    32
+#define SLAB_MAGSIZE    8
+
+struct slab {
+	struct slab_cache * cache;
+	struct slab * prev, * next;     // partial list
+	unsigned nfree;
+	uint16_t free[];
+};
+
+struct slab_magazine {
+	unsigned count;
+	void * objs[SLAB_MAGSIZE];
+};
+
+struct slab_cache {
+	const char * name;
+	size_t size;
+	size_t offset;                  // of the first object in a slab
+	unsigned perslab;
+	int (*ctor)(void *);
+	void (*dtor)(void *);
+	struct spinlock lock;
+	struct slab * partial;
+	struct slab * spare;
+	struct slab_magazine mags[SLAB_MAXCPUS];
+};
+
+static
+struct slab_magazine *
+SlabMagazine(struct slab_cache * sc)
+{
+	if(!CURCPU_EXISTS()) {
+		return &sc->mags[0];
+	}
+	KASSERT(curcpu->c_number < SLAB_MAXCPUS);
+	return &sc->mags[curcpu->c_number];
+}
+
+static
+struct slab *
+SlabOf(void * obj)
+{
+	return (struct slab *)((vaddr_t)obj & PAGE_FRAME);
+}
+
+static
+void *
+SlabObject(struct slab_cache * sc, struct slab * s, unsigned i)
+{
+	return (char *)s + sc->offset + i * sc->size;
+}
+
+static
+void
+SlabUnlink(struct slab_cache * sc, struct slab * s)
+{
+	if(s->prev != NULL) {
+		s->prev->next = s->next;
+	} else {
+		sc->partial = s->next;
+	}
+	if(s->next != NULL) {
+		s->next->prev = s->prev;
+	}
+}
+
+static
+void
+SlabLink(struct slab_cache * sc, struct slab * s)
+{
+	s->prev = NULL;
+	s->next = sc->partial;
+	if(sc->partial != NULL) {
+		sc->partial->prev = s;
+	}
+	sc->partial = s;
+}
+
+/* Take a free object from the slabs, or NULL. Cache lock held. */
+static
+void *
+SlabTake(struct slab_cache * sc)
+{
+	struct slab * s = sc->partial;
+	if(s == NULL) {
+		s = sc->spare;
+		if(s == NULL) {
+			return NULL;
+		}
+		sc->spare = NULL;
+		SlabLink(sc, s);
+	}
+	void * obj = SlabObject(sc, s, s->free[--s->nfree]);
+	if(s->nfree == 0) {
+		SlabUnlink(sc, s);
+	}
+	return obj;
+}
+
+/*
+ * Put OBJ back in its slab. A slab this leaves wholly free becomes the
+ * spare, or is added to *RELEASE. Cache lock held.
+ */
+static
+void
+SlabGive(struct slab_cache * sc, void * obj, struct slab ** release)
+{
+	struct slab * s = SlabOf(obj);
+	KASSERT(s->cache == sc);
+	unsigned i = ((char *)obj - (char *)s - sc->offset) / sc->size;
+	KASSERT(SlabObject(sc, s, i) == obj);
+
+	s->free[s->nfree++] = i;
+	if(s->nfree == 1) {
+		SlabLink(sc, s);
+	}
+	if(s->nfree == sc->perslab) {
+		SlabUnlink(sc, s);
+		if(sc->spare == NULL) {
+			sc->spare = s;
+		} else {
+			s->next = *release;
+			*release = s;
+		}
+	}
+}
+
+/* Destroy the first N objects of S. */
+static
+void
+SlabDestruct(struct slab_cache * sc, struct slab * s, unsigned n)
+{
+	if(sc->dtor == NULL) {
+		return;
+	}
+	for(unsigned i = 0; i != n; i++) {
+		sc->dtor(SlabObject(sc, s, i));
+	}
+}
+
+/* Make a new slab of constructed objects. Called without the lock. */
+static
+struct slab *
+SlabGrow(struct slab_cache * sc)
+{
+	vaddr_t page = alloc_kpages(1);
+	if(page == 0) {
+		return NULL;
+	}
+	struct slab * s = (struct slab *)page;
+	s->cache = sc;
+	s->nfree = sc->perslab;
+	for(unsigned i = 0; i != sc->perslab; i++) {
+		// Lowest addresses handed out first.
+		s->free[i] = sc->perslab - 1 - i;
+	}
+	if(sc->ctor != NULL) {
+		for(unsigned i = 0; i != sc->perslab; i++) {
+			if(sc->ctor(SlabObject(sc, s, i)) != 0) {
+				SlabDestruct(sc, s, i);
+				free_kpages(page);
+				return NULL;
+			}
+		}
+	}
+	return s;
+}
+
+/* Give back the slabs on the list RELEASE. Called without the lock. */
+static
+void
+SlabRelease(struct slab_cache * sc, struct slab * release)
+{
+	while(release != NULL) {
+		struct slab * s = release;
+		release = s->next;
+		SlabDestruct(sc, s, sc->perslab);
+		free_kpages((vaddr_t)s);
+	}
+}
+
+struct slab_cache *
+slab_create(const char * name, size_t size, int (*ctor)(void *), void (*dtor)(void *))
+{
+	size = ROUNDUP(size, SLAB_ALIGN);
+	// As many objects as fit after the header and free stack.
+	unsigned n = (PAGE_SIZE - sizeof(struct slab)) / size;
+	while(n > 0 && ROUNDUP(sizeof(struct slab) + n * sizeof(uint16_t), SLAB_ALIGN) +
+			n * size > PAGE_SIZE) {
+		n--;
+	}
+	KASSERT(n > 0);
+
+	struct slab_cache * sc = kmalloc(sizeof(struct slab_cache));
+	if(sc == NULL) {
+		return NULL;
+	}
+	sc->name = name;
+	sc->size = size;
+	sc->offset = ROUNDUP(sizeof(struct slab) + n * sizeof(uint16_t), SLAB_ALIGN);
+	sc->perslab = n;
+	sc->ctor = ctor;
+	sc->dtor = dtor;
+	spinlock_init(&sc->lock);
+	sc->partial = NULL;
+	sc->spare = NULL;
+	for(unsigned i = 0; i != SLAB_MAXCPUS; i++) {
+		sc->mags[i].count = 0;
+	}
+	return sc;
+}
+
+void *
+slab_alloc(struct slab_cache * sc)
+{
+	int spl = splhigh();
+	struct slab_magazine * mag = SlabMagazine(sc);
+	if(mag->count > 0) {
+		void * obj = mag->objs[--mag->count];
+		splx(spl);
+		return obj;
+	}
+	splx(spl);
+
+	for(;;) {
+		spinlock_acquire(&sc->lock);
+		// Interrupts are off while the spinlock is held, so this is
+		// still the magazine of the CPU we are on.
+		mag = SlabMagazine(sc);
+		void * obj;
+		while(mag->count < SLAB_MAGSIZE / 2 && (obj = SlabTake(sc)) != NULL) {
+			mag->objs[mag->count++] = obj;
+		}
+		obj = mag->count > 0 ? mag->objs[--mag->count] : NULL;
+		spinlock_release(&sc->lock);
+		if(obj != NULL) {
+			return obj;
+		}
+
+		struct slab * s = SlabGrow(sc);
+		if(s == NULL) {
+			return NULL;
+		}
+		spinlock_acquire(&sc->lock);
+		SlabLink(sc, s);
+		spinlock_release(&sc->lock);
+	}
+}
+
+void
+slab_free(struct slab_cache * sc, void * obj)
+{
+	KASSERT(obj != NULL);
+	int spl = splhigh();
+	struct slab_magazine * mag = SlabMagazine(sc);
+	if(mag->count < SLAB_MAGSIZE) {
+		mag->objs[mag->count++] = obj;
+		splx(spl);
+		return;
+	}
+	splx(spl);
+
+	struct slab * release = NULL;
+	spinlock_acquire(&sc->lock);
+	mag = SlabMagazine(sc);
+	SlabGive(sc, obj, &release);
+	while(mag->count > SLAB_MAGSIZE / 2) {
+		SlabGive(sc, mag->objs[--mag->count], &release);
+	}
+	spinlock_release(&sc->lock);
+	SlabRelease(sc, release);
+}